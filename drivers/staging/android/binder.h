@@ -37,6 +37,17 @@ enum {
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy of the minimum priority above:
+	 * 0 SCHED_NORMAL, 1 SCHED_FIFO, 2 SCHED_RR, 3 SCHED_BATCH. The
+	 * priority is a nice value for SCHED_NORMAL and SCHED_BATCH and an
+	 * rt priority otherwise.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK =
+		3U << FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT,
+	/* let real-time callers raise the handler to their rt priority */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
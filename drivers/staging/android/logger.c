@@ -25,6 +25,7 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/hash.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,22 +34,49 @@
 static unsigned int enabled = 1;
 module_param(enabled, uint, S_IWUSR | S_IRUGO);
 
+/*
+ * Per-UID rate limiting: each UID may write 'ratelimit' entries per second,
+ * with bursts of up to 'ratelimit_burst' entries, to all logs combined.
+ * Entries over the limit are dropped. 0 disables rate limiting.
+ */
+static unsigned int ratelimit;
+module_param(ratelimit, uint, S_IWUSR | S_IRUGO);
+static unsigned int ratelimit_burst = 200;
+module_param(ratelimit_burst, uint, S_IWUSR | S_IRUGO);
+
+/* store entry headers in the compact format, see logger_compact_entry */
+static bool compact;
+module_param(compact, bool, S_IRUGO);
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers do not serialize on the whole write. They reserve space for an
+ * entry under 'w_lock', which only covers moving 'head' and 'w_off' and
+ * storing the entry header, then copy the payload from userspace without
+ * any lock held and commit the entry (see LOGGER_ENTRY_PENDING). Readers
+ * serialize among themselves on 'mutex' and never block writers: they
+ * notice on their own when a writer has lapped them by comparing their
+ * distance to 'w_off' with that of 'head' (see reader_lapped()).
+ *
+ * 'w_off', 'head' and reader offsets are free running; use logger_offset()
+ * to turn them into an index into 'buffer'.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	struct mutex		mutex;	/* mutex serializing readers */
+	spinlock_t		w_lock;	/* lock protecting w_off and head */
 	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	size_t			head;	/* oldest entry, new readers start here */
 	size_t			size;	/* size of the log */
+	bool			compact; /* headers are in compact format */
+	struct logger_entry	head_base; /* entry before head (compact) */
+	struct logger_entry	tail_base; /* entry before w_off (compact) */
 };
 
 /*
@@ -59,8 +87,8 @@ struct logger_log {
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	struct logger_entry	r_base;	/* entry before r_off (compact) */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
 };
@@ -68,6 +96,61 @@ struct logger_reader {
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/*
+ * reader_lapped - has a writer reclaimed the entry at the reader's offset?
+ * Distances from 'w_off' are compared rather than the offsets themselves,
+ * so a reader that stayed idle while half the offset space was written is
+ * still seen as lapped. 'head' is read first, so it is never past 'w_off'.
+ */
+static inline bool reader_lapped(struct logger_log *log, size_t r_off)
+{
+	size_t head = ACCESS_ONCE(log->head);
+	size_t w_off = ACCESS_ONCE(log->w_off);
+
+	return w_off - r_off > w_off - head;
+}
+
+/*
+ * Inside the buffer, the hdr_size field of an entry doubles as its commit
+ * state. Space is reserved with LOGGER_ENTRY_PENDING and the entry is
+ * published by setting hdr_size to LOGGER_ENTRY_COMMITTED, or to
+ * LOGGER_ENTRY_DISCARDED if its payload could not be copied. Readers stop
+ * at a pending entry and skip discarded ones. All values fit in the low
+ * byte, so a commit only ever changes a single byte in the buffer.
+ */
+#define LOGGER_ENTRY_PENDING	0
+#define LOGGER_ENTRY_COMMITTED	sizeof(struct logger_entry)
+#define LOGGER_ENTRY_DISCARDED	0xff
+
+/*
+ * struct logger_compact_entry - header of an entry in a compact log
+ *
+ * Only what changed since the previous entry is stored: the fixed part
+ * below is followed by a varint for each field named in 'flags', in the
+ * order of the flags, and by the timestamp. The timestamp is a varint
+ * delta in nanoseconds from the previous entry, unless time went backwards
+ * or jumped by LOGGER_COMPACT_MAX_DELTA or more, in which case the absolute
+ * seconds and nanoseconds follow instead. Decoding an entry needs the
+ * previous one, which the log keeps for the entries at 'head' and 'w_off'
+ * and every reader keeps for the entry at its offset.
+ */
+struct logger_compact_entry {
+	__u16		len;	/* length of the payload */
+	__u16		state;	/* commit state, as logger_entry.hdr_size */
+	__u8		flags;	/* LOGGER_COMPACT_* fields present */
+	__u8		fields[0];
+} __packed;
+
+#define LOGGER_COMPACT_PID	0x01	/* pid, delta from previous pid */
+#define LOGGER_COMPACT_TID	0x02	/* tid, delta from pid */
+#define LOGGER_COMPACT_EUID	0x04	/* euid */
+#define LOGGER_COMPACT_TIME	0x08	/* absolute sec and nsec */
+
+#define LOGGER_COMPACT_MAX_DELTA	(2 * NSEC_PER_SEC)
+
+/* the fixed part and at most five 32-bit varints */
+#define LOGGER_COMPACT_HDR_MAX	(sizeof(struct logger_compact_entry) + 5 * 5)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -91,40 +174,206 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+static size_t put_varint(__u8 *p, __u32 val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		p[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	p[n++] = val;
+
+	return n;
+}
+
+static size_t get_varint(const __u8 *p, size_t size, __u32 *val)
+{
+	unsigned int shift = 0;
+	size_t n = 0;
+
+	*val = 0;
+	while (n < size && shift < 32) {
+		*val |= (__u32) (p[n] & 0x7f) << shift;
+		if (!(p[n++] & 0x80))
+			break;
+		shift += 7;
+	}
+
+	return n;
+}
+
+/* zigzag encoding maps small signed deltas to small varints */
+static inline __u32 zigzag(__s32 val)
+{
+	return ((__u32) val << 1) ^ (__u32) (val >> 31);
+}
+
+static inline __s32 unzigzag(__u32 val)
+{
+	return (__s32) (val >> 1) ^ -(__s32) (val & 1);
+}
+
 /*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * encode_compact_header - stores the header of 'entry' into 'buf' in the
+ * compact format, relative to the previous entry 'base'. Returns the
+ * length of the encoded header.
  */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
-{
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
+static size_t encode_compact_header(const struct logger_entry *base,
+				    const struct logger_entry *entry,
+				    __u8 *buf)
+{
+	struct logger_compact_entry *hdr = (struct logger_compact_entry *) buf;
+	__u8 *p = hdr->fields;
+	__u8 flags = 0;
+	__s64 delta;
+
+	if (entry->pid != base->pid) {
+		flags |= LOGGER_COMPACT_PID;
+		p += put_varint(p, zigzag(entry->pid - base->pid));
 	}
+	if (entry->tid != base->tid) {
+		flags |= LOGGER_COMPACT_TID;
+		p += put_varint(p, zigzag(entry->tid - entry->pid));
+	}
+	if (entry->euid != base->euid) {
+		flags |= LOGGER_COMPACT_EUID;
+		p += put_varint(p, entry->euid);
+	}
+
+	delta = (__s64) (entry->sec - base->sec) * NSEC_PER_SEC +
+		entry->nsec - base->nsec;
+	if (delta < 0 || delta >= LOGGER_COMPACT_MAX_DELTA) {
+		flags |= LOGGER_COMPACT_TIME;
+		p += put_varint(p, entry->sec);
+		p += put_varint(p, entry->nsec);
+	} else
+		p += put_varint(p, delta);
+
+	hdr->len = entry->len;
+	hdr->state = entry->hdr_size;
+	hdr->flags = flags;
 
-	return (struct logger_entry *) (log->buffer + off);
+	return p - buf;
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
- *
- * Caller needs to hold log->mutex.
+ * decode_compact_header - the reverse of encode_compact_header(). 'buf'
+ * may hold garbage if the entry was overwritten while it was copied; the
+ * caller notices and throws the result away, we just must not overrun.
+ */
+static size_t decode_compact_header(const __u8 *buf, size_t size,
+				    const struct logger_entry *base,
+				    struct logger_entry *entry)
+{
+	const struct logger_compact_entry *hdr =
+		(const struct logger_compact_entry *) buf;
+	const __u8 *p = hdr->fields;
+	const __u8 *end = buf + size;
+	__u32 val, nsec;
+
+	entry->len = hdr->len;
+	entry->hdr_size = hdr->state;
+	entry->pid = base->pid;
+	entry->tid = base->tid;
+	entry->euid = base->euid;
+
+	if (hdr->flags & LOGGER_COMPACT_PID) {
+		p += get_varint(p, end - p, &val);
+		entry->pid = base->pid + unzigzag(val);
+	}
+	if (hdr->flags & LOGGER_COMPACT_TID) {
+		p += get_varint(p, end - p, &val);
+		entry->tid = entry->pid + unzigzag(val);
+	}
+	if (hdr->flags & LOGGER_COMPACT_EUID) {
+		p += get_varint(p, end - p, &val);
+		entry->euid = val;
+	}
+
+	if (hdr->flags & LOGGER_COMPACT_TIME) {
+		p += get_varint(p, end - p, &val);
+		entry->sec = val;
+		p += get_varint(p, end - p, &val);
+		entry->nsec = val;
+	} else {
+		p += get_varint(p, end - p, &val);
+		entry->sec = base->sec;
+		nsec = base->nsec + val;
+		while (nsec >= NSEC_PER_SEC) {
+			nsec -= NSEC_PER_SEC;
+			entry->sec++;
+		}
+		entry->nsec = nsec;
+	}
+
+	return p - buf;
+}
+
+/*
+ * do_read_log - copies 'count' bytes at offset 'off' of 'log' into 'buf'
+ */
+static void do_read_log(struct logger_log *log, size_t off,
+			void *buf, size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * get_entry_header - copies the header of the entry within 'log' starting
+ * at offset 'off' into 'entry', decoding it against the previous entry
+ * 'base' if the log is compact. Returns the length of the header in the
+ * buffer. The header is always copied, as it may span the end and
+ * beginning of the circular buffer and, for readers, may be overwritten
+ * by a writer at any time.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static size_t get_entry_header(struct logger_log *log, size_t off,
+			       const struct logger_entry *base,
+			       struct logger_entry *entry)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	__u8 buf[LOGGER_COMPACT_HDR_MAX];
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	if (!log->compact) {
+		do_read_log(log, off, entry, sizeof(struct logger_entry));
+		return sizeof(struct logger_entry);
+	}
+
+	do_read_log(log, off, buf, sizeof(buf));
+	return decode_compact_header(buf, sizeof(buf), base, entry);
+}
+
+/*
+ * logger_catch_up - moves a reader that was lapped by a writer to the
+ * oldest entry
+ */
+static void logger_catch_up(struct logger_log *log,
+			    struct logger_reader *reader)
+{
+	spin_lock(&log->w_lock);
+	if (reader_lapped(log, reader->r_off)) {
+		reader->r_off = log->head;
+		reader->r_base = log->head_base;
+	}
+	spin_unlock(&log->w_lock);
+}
+
+/*
+ * logger_resync - moves a reader that lost track of the entries to the
+ * oldest entry
+ */
+static void logger_resync(struct logger_log *log,
+			  struct logger_reader *reader)
+{
+	spin_lock(&log->w_lock);
+	reader->r_off = log->head;
+	reader->r_base = log->head_base;
+	spin_unlock(&log->w_lock);
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -160,18 +409,21 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads the entry 'entry' at the reader's offset
+ * into the user-space buffer 'buf', which holds at least 'count' bytes,
+ * the size of the entry as seen by the reader. Returns 'count' on success
+ * and 0 if a writer lapped the reader while the entry was being copied,
+ * in which case the caller must try again.
  *
  * Caller must hold log->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
+				   struct logger_entry *entry,
+				   size_t hdr_len,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
 	size_t len;
 	size_t msg_start;
 
@@ -179,13 +431,12 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
 	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
+	msg_start = logger_offset(reader->r_off + hdr_len);
 
 	/*
 	 * We read from the msg in two disjoint operations. First, we read from
@@ -204,34 +455,74 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off +
-		sizeof(struct logger_entry) + count);
+	/* did a writer reclaim the entry while we were copying it? */
+	smp_rmb();
+	if (reader_lapped(log, reader->r_off))
+		return 0;
+
+	reader->r_off += hdr_len + count;
+	reader->r_base = *entry;
 
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * get_next_entry - moves the reader to the next committed entry it may
+ * read and copies that entry's header into 'entry', and the length of the
+ * header in the buffer into 'hdr_len'. Readers that have been lapped are
+ * pulled forward to the oldest entry, and entries that were discarded or,
+ * unless the reader can read all entries, that belong to another euid are
+ * skipped. Returns false if there is no such entry yet.
+ *
+ * Caller must hold log->mutex.
  */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
+static bool get_next_entry(struct logger_log *log,
+			   struct logger_reader *reader,
+			   struct logger_entry *entry, size_t *hdr_len)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
+	size_t w_off;
 
-		entry = get_entry_header(log, off, &scratch);
+	while (1) {
+		if (reader_lapped(log, reader->r_off))
+			logger_catch_up(log, reader);
+
+		w_off = ACCESS_ONCE(log->w_off);
+		if (reader->r_off == w_off)
+			return false;
+
+		/*
+		 * Read w_off before the header it covers; pairs with the
+		 * smp_wmb() in logger_reserve()
+		 */
+		smp_rmb();
+		*hdr_len = get_entry_header(log, reader->r_off,
+					    &reader->r_base, entry);
+
+		/* pairs with the smp_wmb() in logger_commit() */
+		smp_rmb();
+		if (reader_lapped(log, reader->r_off))
+			continue;
+
+		/*
+		 * Should the offsets ever wrap past a reader, it would decode
+		 * garbage; never let such an entry reach the copy.
+		 */
+		if (unlikely(entry->len > LOGGER_ENTRY_MAX_PAYLOAD ||
+			     w_off - reader->r_off < *hdr_len + entry->len)) {
+			logger_resync(log, reader);
+			continue;
+		}
 
-		if (entry->euid == euid)
-			return off;
+		if (entry->hdr_size == LOGGER_ENTRY_PENDING)
+			return false;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(off + next_len);
-	}
+		if (entry->hdr_size != LOGGER_ENTRY_DISCARDED &&
+		    (reader->r_all || entry->euid == current_euid()))
+			return true;
 
-	return off;
+		reader->r_off += *hdr_len + entry->len;
+		reader->r_base = *entry;
+	}
 }
 
 /*
@@ -251,6 +542,8 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry entry;
+	size_t hdr_len;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -259,7 +552,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		ret = !get_next_entry(log, reader, &entry, &hdr_len);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -283,26 +576,25 @@ start:
 
 	mutex_lock(&log->mutex);
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(!get_next_entry(log, reader, &entry, &hdr_len))) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, reader, &entry, hdr_len, buf, ret);
+	if (unlikely(!ret)) {
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
 
 out:
 	mutex_unlock(&log->mutex);
@@ -311,123 +603,247 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
-	size_t count = 0;
+	size_t len;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
-	return off;
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at offset 'off', which the caller has reserved.
+ *
+ * Returns 'count' on success, negative error code on failure.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
+				      const void __user *buf, size_t count)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
+		return -EFAULT;
+
+	if (count != len)
+		if (copy_from_user(log->buffer, buf + len, count - len))
+			return -EFAULT;
+
+	/* print as kernel log if the log string starts with "!@" */
+	if (count >= 2) {
+		if (log->buffer[off] == '!'
+		    && log->buffer[logger_offset(off + 1)] == '@') {
+			char tmp[256];
+			int i;
+			for (i = 0; i < min(count, sizeof(tmp) - 1); i++)
+				tmp[i] =
+				    log->buffer[logger_offset(off + i)];
+			tmp[i] = '\0';
+			printk("%s\n", tmp);
+		}
 	}
 
-	return 0;
+	return count;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * head_is_pending - is the oldest entry in 'log' still being written?
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static bool head_is_pending(struct logger_log *log)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	struct logger_entry entry;
+	bool ret = false;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	spin_lock(&log->w_lock);
+	if (log->head != log->w_off) {
+		get_entry_header(log, log->head, &log->head_base, &entry);
+		ret = entry.hdr_size == LOGGER_ENTRY_PENDING;
+	}
+	spin_unlock(&log->w_lock);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return ret;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_reserve - reserves room for the entry described by 'header' and
+ * stores the header, marked pending, at the start of it. The offset of the
+ * entry and the length of its header are returned in 'off' and 'hdr_len'.
  *
- * The caller needs to hold log->mutex.
+ * The oldest entries are reclaimed to make room. An entry that is still
+ * being written cannot be reclaimed; in the unlikely case the whole log is
+ * taken by such entries, we wait for them to be committed.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static int logger_reserve(struct logger_log *log, struct logger_entry *header,
+			  size_t *off, size_t *hdr_len)
 {
-	size_t len;
+	__u8 buf[LOGGER_COMPACT_HDR_MAX];
+	struct logger_entry entry;
+	size_t len, n;
+	int ret;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	header->hdr_size = LOGGER_ENTRY_PENDING;
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+	spin_lock(&log->w_lock);
+again:
+	if (log->compact)
+		*hdr_len = encode_compact_header(&log->tail_base, header, buf);
+	else
+		*hdr_len = sizeof(struct logger_entry);
+	len = *hdr_len + header->len;
+
+	while (log->w_off + len - log->head > log->size) {
+		n = get_entry_header(log, log->head, &log->head_base, &entry);
+		if (unlikely(entry.hdr_size == LOGGER_ENTRY_PENDING)) {
+			spin_unlock(&log->w_lock);
+			ret = wait_event_interruptible(log->wq,
+						       !head_is_pending(log));
+			if (ret)
+				return ret;
+			spin_lock(&log->w_lock);
+			goto again;
+		}
+		log->head += n + entry.len;
+		log->head_base = entry;
+	}
 
-	log->w_off = logger_offset(log->w_off + count);
+	/*
+	 * Readers must see the new head before any of the space it freed
+	 * is overwritten, and the header before the new write offset.
+	 */
+	smp_wmb();
+	*off = log->w_off;
+	if (log->compact)
+		do_write_log(log, *off, buf, *hdr_len);
+	else
+		do_write_log(log, *off, header, sizeof(struct logger_entry));
+	smp_wmb();
+	log->w_off += len;
+	log->tail_base = *header;
+	spin_unlock(&log->w_lock);
 
+	return 0;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * logger_commit - publishes the entry at 'off' with commit state 'state'
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void logger_commit(struct logger_log *log, size_t off, __u16 state)
 {
-	size_t len;
+	BUILD_BUG_ON(offsetof(struct logger_compact_entry, state) !=
+		     offsetof(struct logger_entry, hdr_size));
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	/* the payload must be visible before the entry is */
+	smp_wmb();
+	do_write_log(log, off + offsetof(struct logger_entry, hdr_size),
+		     &state, sizeof(state));
+}
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+#define LOGGER_RATELIMIT_BITS	6
 
-	/* print as kernel log if the log string starts with "!@" */
-	if (count >= 2) {
-		if (log->buffer[log->w_off] == '!'
-		    && log->buffer[logger_offset(log->w_off + 1)] == '@') {
-			char tmp[256];
-			int i;
-			for (i = 0; i < min(count, sizeof(tmp) - 1); i++)
-				tmp[i] =
-				    log->buffer[logger_offset(log->w_off + i)];
-			tmp[i] = '\0';
-			printk("%s\n", tmp);
-		}
+/*
+ * struct logger_ratelimit - token bucket of the UIDs hashing to a slot
+ *
+ * A slot only tracks the last UID that hashed to it. Another UID taking
+ * over the slot inherits the remaining tokens, so UIDs sharing a slot
+ * share its rate rather than refilling each other's bucket.
+ */
+struct logger_ratelimit {
+	spinlock_t		lock;
+	bool			used;	/* uid is valid */
+	uid_t			uid;
+	unsigned long		tokens;	/* in 1/HZ of an entry */
+	unsigned long		stamp;	/* jiffies at the last refill */
+	unsigned long		dropped; /* since the last accepted entry */
+	unsigned long		total_dropped;
+};
+
+static struct logger_ratelimit logger_ratelimits[1 << LOGGER_RATELIMIT_BITS];
+
+/*
+ * logger_ratelimited - charges an entry to 'uid' and returns true if the
+ * entry must be dropped because the UID is over its rate
+ */
+static bool logger_ratelimited(uid_t uid)
+{
+	unsigned int rate = ACCESS_ONCE(ratelimit);
+	unsigned long max = max(ACCESS_ONCE(ratelimit_burst), 1U) * HZ;
+	unsigned long now = jiffies;
+	unsigned long dropped = 0, prev_dropped = 0;
+	struct logger_ratelimit *rl;
+	uid_t prev_uid = 0;
+	bool ret = false;
+
+	if (!rate)
+		return false;
+
+	rl = &logger_ratelimits[hash_long(uid, LOGGER_RATELIMIT_BITS)];
+
+	spin_lock(&rl->lock);
+	if (!rl->used) {
+		rl->used = true;
+		rl->uid = uid;
+		rl->tokens = max;
+	} else if (now - rl->stamp >= max / rate)
+		rl->tokens = max;
+	else
+		rl->tokens = min(rl->tokens + (now - rl->stamp) * rate, max);
+	rl->stamp = now;
+
+	if (rl->uid != uid) {
+		prev_uid = rl->uid;
+		prev_dropped = rl->dropped;
+		rl->uid = uid;
+		rl->dropped = 0;
 	}
 
-	log->w_off = logger_offset(log->w_off + count);
+	if (rl->tokens >= HZ) {
+		rl->tokens -= HZ;
+		dropped = rl->dropped;
+		rl->dropped = 0;
+	} else {
+		rl->dropped++;
+		rl->total_dropped++;
+		ret = true;
+	}
+	spin_unlock(&rl->lock);
 
-	return count;
+	if (prev_dropped && printk_ratelimit())
+		printk(KERN_INFO "logger: dropped %lu entries from uid %u\n",
+		       prev_dropped, prev_uid);
+	if (dropped && printk_ratelimit())
+		printk(KERN_INFO "logger: dropped %lu entries from uid %u\n",
+		       dropped, uid);
+
+	return ret;
+}
+
+static int logger_get_dropped(char *buffer, const struct kernel_param *kp)
+{
+	unsigned long dropped = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(logger_ratelimits); i++)
+		dropped += ACCESS_ONCE(logger_ratelimits[i].total_dropped);
+
+	return sprintf(buffer, "%lu", dropped);
 }
 
+static struct kernel_param_ops logger_dropped_ops = {
+	.get = logger_get_dropped,
+};
+
+/* total number of entries dropped by rate limiting */
+module_param_cb(dropped, &logger_dropped_ops, NULL, S_IRUGO);
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -437,9 +853,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t off, hdr_len;
 	ssize_t ret = 0;
 
 	if (!enabled)
@@ -453,23 +869,19 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	header.nsec = now.tv_nsec;
 	header.euid = current_euid();
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
-	header.hdr_size = sizeof(struct logger_entry);
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	/* entries over the rate limit are silently dropped */
+	if (logger_ratelimited(header.euid))
+		return header.len;
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	ret = logger_reserve(log, &header, &off, &hdr_len);
+	if (unlikely(ret))
+		return ret;
+	off += hdr_len;
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -479,10 +891,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off + ret, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			logger_commit(log, off - hdr_len,
+				      LOGGER_ENTRY_DISCARDED);
+			wake_up_interruptible(&log->wq);
 			return nr;
 		}
 
@@ -490,9 +903,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	logger_commit(log, off - hdr_len, LOGGER_ENTRY_COMMITTED);
 
-	/* wake up any blocked readers */
+	/* wake up any blocked readers, and writers waiting for room */
 	wake_up_interruptible(&log->wq);
 
 	return ret;
@@ -530,12 +943,10 @@ static int logger_open(struct inode *inode, struct file *file)
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
+		spin_lock(&log->w_lock);
 		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		reader->r_base = log->head_base;
+		spin_unlock(&log->w_lock);
 
 		file->private_data = reader;
 	} else
@@ -553,15 +964,7 @@ static int logger_release(struct inode *inode, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		struct logger_log *log;
-		unsigned long start = jiffies;
-		log = get_log_from_minor(MINOR(inode->i_rdev));
-		mutex_lock(&log->mutex);
-		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
 		kfree(reader);
-		pr_info("%s: took %d msec\n", __func__,
-			jiffies_to_msecs(jiffies - start));
 	}
 
 	return 0;
@@ -580,6 +983,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry entry;
+	size_t hdr_len;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -591,11 +996,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	if (get_next_entry(log, reader, &entry, &hdr_len))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -619,6 +1020,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry entry;
+	size_t hdr_len;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
@@ -634,10 +1037,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		if (reader_lapped(log, reader->r_off))
+			logger_catch_up(log, reader);
+		ret = ACCESS_ONCE(log->w_off) - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -646,13 +1048,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (get_next_entry(log, reader, &entry, &hdr_len))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
 		break;
@@ -661,9 +1058,21 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/*
+		 * Readers catch up with the new head on their own. Entries
+		 * still being written cannot be dropped, so stop at the
+		 * first of them.
+		 */
+		spin_lock(&log->w_lock);
+		while (log->head != log->w_off) {
+			hdr_len = get_entry_header(log, log->head,
+						   &log->head_base, &entry);
+			if (entry.hdr_size == LOGGER_ENTRY_PENDING)
+				break;
+			log->head += hdr_len + entry.len;
+			log->head_base = entry;
+		}
+		spin_unlock(&log->w_lock);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -716,8 +1125,8 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.w_lock = __SPIN_LOCK_UNLOCKED(VAR .w_lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -752,6 +1161,8 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->compact = compact;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -767,7 +1178,10 @@ static int __init init_log(struct logger_log *log)
 
 static int __init logger_init(void)
 {
-	int ret;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(logger_ratelimits); i++)
+		spin_lock_init(&logger_ratelimits[i].lock);
 
 	ret = init_log(&log_main);
 	if (unlikely(ret))
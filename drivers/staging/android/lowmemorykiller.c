@@ -15,6 +15,8 @@
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
+ * With CONFIG_VMPRESSURE, writing 1 to /sys/module/lowmemorykiller/parameters/
+ * vmpressure lets the reclaim efficiency reported by vmpressure adjust this.
  *
  * Copyright (C) 2007-2008 Google, Inc.
  *
@@ -35,6 +37,9 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/vmpressure.h>
 #define ENHANCED_LMK_ROUTINE
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
@@ -105,6 +110,92 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+#ifdef CONFIG_VMPRESSURE
+/*
+ * When enabled, the last vmpressure level adjusts the minfree thresholds:
+ * at critical pressure the file cache is not giving pages back, so it is
+ * no longer counted as free; at low pressure reclaim keeps up, so only
+ * the first (lowest) minfree threshold applies. Levels older than a
+ * second are ignored.
+ */
+static int lowmem_vmpressure;
+static enum vmpressure_levels lowmem_vmpressure_level;
+static unsigned long lowmem_vmpressure_stamp;
+
+static int lowmem_vmpressure_notify(struct notifier_block *self,
+				    unsigned long level, void *data)
+{
+	lowmem_vmpressure_level = level;
+	lowmem_vmpressure_stamp = jiffies;
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call	= lowmem_vmpressure_notify,
+};
+#endif
+
+/*
+ * Thread group leaders sorted by oom_adj, so that lowmem_shrink() can walk
+ * them from the highest oom_adj down and stop at min_adj instead of scanning
+ * every process under tasklist_lock. The key is a copy of signal->oom_adj
+ * taken when the task is (re)inserted; /proc/<pid>/oom_adj and oom_score_adj
+ * writes re-key the leader through lowmem_adj_tree_update(). Tasks are
+ * removed when they are freed, which may happen from softirq context.
+ */
+static struct rb_root lowmem_adj_tree = RB_ROOT;
+static DEFINE_SPINLOCK(lowmem_adj_tree_lock);
+
+static void __lowmem_adj_tree_insert(struct task_struct *p)
+{
+	struct rb_node **link = &lowmem_adj_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct task_struct *entry;
+
+	p->lowmem_adj_key = p->signal->oom_adj;
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct task_struct, lowmem_adj_node);
+		if (p->lowmem_adj_key < entry->lowmem_adj_key)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&p->lowmem_adj_node, parent, link);
+	rb_insert_color(&p->lowmem_adj_node, &lowmem_adj_tree);
+}
+
+static void __lowmem_adj_tree_erase(struct task_struct *p)
+{
+	rb_erase(&p->lowmem_adj_node, &lowmem_adj_tree);
+	RB_CLEAR_NODE(&p->lowmem_adj_node);
+}
+
+void lowmem_adj_tree_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_tree_lock, flags);
+	if (RB_EMPTY_NODE(&p->lowmem_adj_node))
+		__lowmem_adj_tree_insert(p);
+	spin_unlock_irqrestore(&lowmem_adj_tree_lock, flags);
+}
+
+/* Called with task_lock(p) and p->sighand->siglock held */
+void lowmem_adj_tree_update(struct task_struct *p)
+{
+	struct task_struct *leader = p->group_leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_tree_lock, flags);
+	if (!RB_EMPTY_NODE(&leader->lowmem_adj_node) &&
+	    leader->lowmem_adj_key != leader->signal->oom_adj) {
+		__lowmem_adj_tree_erase(leader);
+		__lowmem_adj_tree_insert(leader);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_tree_lock, flags);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -116,9 +207,17 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
-
+	unsigned long flags;
 #ifdef ENHANCED_LMK_ROUTINE
 	int i = 0;
+#endif
+
+	spin_lock_irqsave(&lowmem_adj_tree_lock, flags);
+	if (!RB_EMPTY_NODE(&task->lowmem_adj_node))
+		__lowmem_adj_tree_erase(task);
+	spin_unlock_irqrestore(&lowmem_adj_tree_lock, flags);
+
+#ifdef ENHANCED_LMK_ROUTINE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++)
 		if (task == lowmem_deathpending[i]) {
 			lowmem_deathpending[i] = NULL;
@@ -134,6 +233,8 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *p;
+	struct rb_node *n;
+	unsigned long flags;
 #ifdef ENHANCED_LMK_ROUTINE
 	struct task_struct *selected[LOWMEM_DEATHPENDING_DEPTH] = {NULL,};
 #else
@@ -180,6 +281,16 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+#ifdef CONFIG_VMPRESSURE
+	if (lowmem_vmpressure &&
+	    time_before_eq(jiffies, lowmem_vmpressure_stamp + HZ)) {
+		if (lowmem_vmpressure_level == VMPRESSURE_CRITICAL)
+			other_file = 0;
+		else if (lowmem_vmpressure_level == VMPRESSURE_LOW &&
+			 array_size > 1)
+			array_size = 1;
+	}
+#endif
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -208,23 +319,35 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	selected_oom_adj = min_adj;
 #endif
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
+	/*
+	 * Walk down from the highest oom_adj. Once we are below min_adj, or
+	 * below every task already selected, nothing further can be chosen.
+	 * task_lock() nests outside the tree lock in the oom_adj writers,
+	 * so only try it here and skip tasks that are busy.
+	 */
+	spin_lock_irqsave(&lowmem_adj_tree_lock, flags);
+	for (n = rb_last(&lowmem_adj_tree); n; n = rb_prev(n)) {
 		struct mm_struct *mm;
-		struct signal_struct *sig;
 		int oom_adj;
 #ifdef ENHANCED_LMK_ROUTINE
 		int is_exist_oom_task = 0;
 #endif
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
+		p = rb_entry(n, struct task_struct, lowmem_adj_node);
+		oom_adj = p->lowmem_adj_key;
+		if (oom_adj < min_adj)
+			break;
+#ifdef ENHANCED_LMK_ROUTINE
+		if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH &&
+		    oom_adj < selected_oom_adj[max_selected_oom_idx])
+			break;
+#else
+		if (selected && oom_adj < selected_oom_adj)
+			break;
+#endif
+		if (!spin_trylock(&p->alloc_lock))
 			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+		mm = p->mm;
+		if (!mm) {
 			task_unlock(p);
 			continue;
 		}
@@ -284,9 +407,24 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     p->pid, p->comm, oom_adj, tasksize);
 #endif
 	}
+	/*
+	 * Pin the victims before dropping the tree lock; the tasklist_lock
+	 * then keeps their sighand around while we signal them.
+	 */
+#ifdef ENHANCED_LMK_ROUTINE
+	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++)
+		if (selected[i])
+			get_task_struct(selected[i]);
+#else
+	if (selected)
+		get_task_struct(selected);
+#endif
+	spin_unlock_irqrestore(&lowmem_adj_tree_lock, flags);
+
+	read_lock(&tasklist_lock);
 #ifdef ENHANCED_LMK_ROUTINE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-		if (selected[i]) {
+		if (selected[i] && pid_alive(selected[i])) {
 			lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 				selected[i]->pid, selected[i]->comm,
 				selected_oom_adj[i], selected_tasksize[i]);
@@ -297,7 +435,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		}
 	}
 #else
-	if (selected) {
+	if (selected && pid_alive(selected)) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
@@ -306,10 +444,19 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		force_sig(SIGKILL, selected);
 		rem -= selected_tasksize;
 	}
+#endif
+	read_unlock(&tasklist_lock);
+
+#ifdef ENHANCED_LMK_ROUTINE
+	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++)
+		if (selected[i])
+			put_task_struct(selected[i]);
+#else
+	if (selected)
+		put_task_struct(selected);
 #endif
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -519,6 +666,9 @@ static int __init lowmem_init(void)
 
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+#ifdef CONFIG_VMPRESSURE
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
+#endif
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	for_each_zone(zone) {
@@ -552,6 +702,9 @@ static int __init lowmem_init(void)
 
 static void __exit lowmem_exit(void)
 {
+#ifdef CONFIG_VMPRESSURE
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
+#endif
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
 }
@@ -562,6 +715,9 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+#ifdef CONFIG_VMPRESSURE
+module_param_named(vmpressure, lowmem_vmpressure, int, S_IRUGO | S_IWUSR);
+#endif
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
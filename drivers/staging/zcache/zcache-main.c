@@ -24,6 +24,7 @@
 #include <linux/cpu.h>
 #include <linux/highmem.h>
 #include <linux/list.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
@@ -141,6 +142,11 @@ static inline int zcache_comp_op(enum comp_op op,
  * (3) one of PAGE_SIZE/64 "unbuddied" lists indexed by how many chunks
  * the one unbuddied zbud uses.  The data inside a zbpg cannot be
  * read or written unless the zbpg's lock is held.
+ *
+ * The buddied and unbuddied lists are kept per cpu ("budlists"), so
+ * that puts and flushes on different cpus do not serialize on a single
+ * lock.  A zbpg is put on the budlists of the cpu that allocates it and
+ * stays there until it is freed or evicted; zbpg->cpu records which.
  */
 
 #define ZBH_SENTINEL  0x43214321
@@ -160,6 +166,7 @@ struct zbud_hdr {
 struct zbud_page {
 	struct list_head bud_list;
 	spinlock_t lock;
+	int cpu; /* owner of the budlists we are on */
 	struct zbud_hdr buddy[ZBUD_MAX_BUDS];
 	DECL_SENTINEL
 	/* followed by NUM_CHUNK aligned CHUNK_SIZE-byte chunks */
@@ -172,19 +179,29 @@ struct zbud_page {
 				CHUNK_MASK) >> CHUNK_SHIFT)
 #define MAX_CHUNK	(NCHUNKS-1)
 
-static struct {
+struct zbud_list {
 	struct list_head list;
 	unsigned count;
-} zbud_unbuddied[NCHUNKS];
-/* list N contains pages with N chunks USED and NCHUNKS-N unused */
-/* element 0 is never used but optimizing that isn't worth it */
-static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
+};
 
-struct list_head zbud_buddied_list;
-static unsigned long zcache_zbud_buddied_count;
+struct zbud_budlists {
+	/* protects the buddied list and all unbuddied lists of this cpu */
+	spinlock_t lock;
+	struct zbud_list buddied;
+	/* list N contains pages with N chunks USED and NCHUNKS-N unused */
+	/* element 0 is never used but optimizing that isn't worth it */
+	struct zbud_list unbuddied[NCHUNKS];
+	/* lock statistics, updated with the lock held */
+	unsigned long lock_count;
+	unsigned long lock_contended;
+	u64 lock_hold_ns;
+	u64 lock_hold_max_ns;
+	u64 locked_at;
+};
 
-/* protects the buddied list and all unbuddied lists */
-static DEFINE_SPINLOCK(zbud_budlists_spinlock);
+static DEFINE_PER_CPU(struct zbud_budlists, zbud_budlists);
+
+static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
 
 static LIST_HEAD(zbpg_unused_list);
 static unsigned long zcache_zbpg_unused_list_count;
@@ -255,6 +272,36 @@ static char *zbud_data(struct zbud_hdr *zh, unsigned size)
 	return p;
 }
 
+/*
+ * zbud budlists locking, which also keeps track of how long the lock is
+ * held and how often it is contended
+ */
+
+static struct zbud_budlists *zbud_budlists_lock(int cpu)
+{
+	struct zbud_budlists *bl = &per_cpu(zbud_budlists, cpu);
+	bool contended = false;
+
+	if (unlikely(!spin_trylock(&bl->lock))) {
+		spin_lock(&bl->lock);
+		contended = true;
+	}
+	bl->lock_count++;
+	bl->lock_contended += contended;
+	bl->locked_at = sched_clock();
+	return bl;
+}
+
+static void zbud_budlists_unlock(struct zbud_budlists *bl)
+{
+	u64 held = sched_clock() - bl->locked_at;
+
+	bl->lock_hold_ns += held;
+	if (held > bl->lock_hold_max_ns)
+		bl->lock_hold_max_ns = held;
+	spin_unlock(&bl->lock);
+}
+
 /*
  * zbud raw page management
  */
@@ -343,32 +390,42 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	unsigned budnum = zbud_budnum(zh), size;
 	struct zbud_page *zbpg =
 		container_of(zh, struct zbud_page, buddy[budnum]);
+	struct zbud_budlists *bl;
+	int cpu;
 
-	spin_lock(&zbud_budlists_spinlock);
+retry:
+	cpu = ACCESS_ONCE(zbpg->cpu);
+	bl = zbud_budlists_lock(cpu);
 	spin_lock(&zbpg->lock);
 	if (list_empty(&zbpg->bud_list)) {
 		/* ignore zombie page... see zbud_evict_pages() */
 		spin_unlock(&zbpg->lock);
-		spin_unlock(&zbud_budlists_spinlock);
+		zbud_budlists_unlock(bl);
 		return;
 	}
+	if (unlikely(zbpg->cpu != cpu)) {
+		/* recycled onto other budlists before we got the lock */
+		spin_unlock(&zbpg->lock);
+		zbud_budlists_unlock(bl);
+		goto retry;
+	}
 	size = zbud_free(zh);
 	ASSERT_SPINLOCK(&zbpg->lock);
 	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
 	if (zh_other->size == 0) { /* was unbuddied: unlist and free */
 		chunks = zbud_size_to_chunks(size) ;
-		BUG_ON(list_empty(&zbud_unbuddied[chunks].list));
+		BUG_ON(list_empty(&bl->unbuddied[chunks].list));
 		list_del_init(&zbpg->bud_list);
-		zbud_unbuddied[chunks].count--;
-		spin_unlock(&zbud_budlists_spinlock);
+		bl->unbuddied[chunks].count--;
+		zbud_budlists_unlock(bl);
 		zbud_free_raw_page(zbpg);
 	} else { /* was buddied: move remaining buddy to unbuddied list */
 		chunks = zbud_size_to_chunks(zh_other->size) ;
 		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		list_add_tail(&zbpg->bud_list, &zbud_unbuddied[chunks].list);
-		zbud_unbuddied[chunks].count++;
-		spin_unlock(&zbud_budlists_spinlock);
+		bl->buddied.count--;
+		list_add_tail(&zbpg->bud_list, &bl->unbuddied[chunks].list);
+		bl->unbuddied[chunks].count++;
+		zbud_budlists_unlock(bl);
 		spin_unlock(&zbpg->lock);
 	}
 }
@@ -379,34 +436,36 @@ static struct zbud_hdr *zbud_create(uint16_t client_id, uint16_t pool_id,
 					void *cdata, unsigned size)
 {
 	struct zbud_hdr *zh0, *zh1, *zh = NULL;
-	struct zbud_page *zbpg = NULL, *ztmp;
+	struct zbud_page *zbpg = NULL;
+	struct zbud_budlists *bl;
 	unsigned nchunks;
 	char *to;
-	int i, found_good_buddy = 0;
+	int i, cpu, found_good_buddy = 0;
 
+	/* puts run with interrupts disabled, so we stay on this cpu */
+	BUG_ON(!irqs_disabled());
+	cpu = smp_processor_id();
 	nchunks = zbud_size_to_chunks(size) ;
+	bl = zbud_budlists_lock(cpu);
 	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
-		spin_lock(&zbud_budlists_spinlock);
-		if (!list_empty(&zbud_unbuddied[i].list)) {
-			list_for_each_entry_safe(zbpg, ztmp,
-				    &zbud_unbuddied[i].list, bud_list) {
-				if (spin_trylock(&zbpg->lock)) {
-					found_good_buddy = i;
-					goto found_unbuddied;
-				}
+		list_for_each_entry(zbpg, &bl->unbuddied[i].list, bud_list) {
+			if (spin_trylock(&zbpg->lock)) {
+				found_good_buddy = i;
+				goto found_unbuddied;
 			}
 		}
-		spin_unlock(&zbud_budlists_spinlock);
 	}
+	zbud_budlists_unlock(bl);
 	/* didn't find a good buddy, try allocating a new page */
 	zbpg = zbud_alloc_raw_page();
 	if (unlikely(zbpg == NULL))
 		goto out;
 	/* ok, have a page, now compress the data before taking locks */
-	spin_lock(&zbud_budlists_spinlock);
+	bl = zbud_budlists_lock(cpu);
 	spin_lock(&zbpg->lock);
-	list_add_tail(&zbpg->bud_list, &zbud_unbuddied[nchunks].list);
-	zbud_unbuddied[nchunks].count++;
+	zbpg->cpu = cpu;
+	list_add_tail(&zbpg->bud_list, &bl->unbuddied[nchunks].list);
+	bl->unbuddied[nchunks].count++;
 	zh = &zbpg->buddy[0];
 	goto init_zh;
 
@@ -423,9 +482,9 @@ found_unbuddied:
 	} else
 		BUG();
 	list_del_init(&zbpg->bud_list);
-	zbud_unbuddied[found_good_buddy].count--;
-	list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
-	zcache_zbud_buddied_count++;
+	bl->unbuddied[found_good_buddy].count--;
+	list_add_tail(&zbpg->bud_list, &bl->buddied.list);
+	bl->buddied.count++;
 
 init_zh:
 	SET_SENTINEL(zh, ZBH);
@@ -437,7 +496,7 @@ init_zh:
 	to = zbud_data(zh, size);
 	memcpy(to, cdata, size);
 	spin_unlock(&zbpg->lock);
-	spin_unlock(&zbud_budlists_spinlock);
+	zbud_budlists_unlock(bl);
 
 	zbud_cumul_chunk_counts[nchunks]++;
 	atomic_inc(&zcache_zbud_curr_zpages);
@@ -530,6 +589,34 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 	zbud_free_raw_page(zbpg);
 }
 
+/* maximum number of pages taken off a cpu's budlists per lock hold */
+#define ZBUD_EVICT_BATCH 16
+
+/*
+ * Take up to 'nr' pages off 'zl' and add them to 'batch', which already
+ * holds 'n' pages.  A page whose lock is busy is in use by another cpu and
+ * is skipped.  Delisting a page turns it into a zombie that nobody but the
+ * evictor will touch anymore, so its lock need not be held until it is
+ * actually evicted.  Caller must hold the budlists lock.
+ */
+static int zbud_evict_collect(struct zbud_list *zl, struct zbud_page **batch,
+				int n, int nr)
+{
+	struct zbud_page *zbpg, *ztmp;
+
+	list_for_each_entry_safe(zbpg, ztmp, &zl->list, bud_list) {
+		if (n >= nr)
+			break;
+		if (unlikely(!spin_trylock(&zbpg->lock)))
+			continue;
+		list_del_init(&zbpg->bud_list);
+		zl->count--;
+		spin_unlock(&zbpg->lock);
+		batch[n++] = zbpg;
+	}
+	return n;
+}
+
 /*
  * Free nr pages.  This code is funky because we want to hold the locks
  * protecting various lists for as short a time as possible, and in some
@@ -537,11 +624,15 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
  * not held.  In some cases we also trylock not only to avoid waiting on a
  * page in use by another cpu, but also to avoid potential deadlock due to
  * lock inversion.
+ *
+ * Pages are taken off each cpu's budlists in batches of ZBUD_EVICT_BATCH
+ * with a single lock hold, and evicted once the budlists are unlocked.
  */
 static void zbud_evict_pages(int nr)
 {
-	struct zbud_page *zbpg;
-	int i;
+	struct zbud_page *zbpg, *batch[ZBUD_EVICT_BATCH];
+	struct zbud_budlists *bl;
+	int buddied, cpu, i, n, want;
 
 	/* first try freeing any pages on unused list */
 retry_unused_list:
@@ -562,65 +653,58 @@ retry_unused_list:
 	}
 	spin_unlock_bh(&zbpg_unused_list_spinlock);
 
-	/* now try freeing unbuddied pages, starting with least space avail */
-	for (i = 0; i < MAX_CHUNK; i++) {
-retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
-		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
-			if (unlikely(!spin_trylock(&zbpg->lock)))
-				continue;
-			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
-			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
-			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
-			local_bh_enable();
-			if (--nr <= 0)
-				goto out;
-			goto retry_unbud_list_i;
+	/*
+	 * now try freeing unbuddied pages, starting with least space avail,
+	 * and as a last resort, free buddied pages
+	 */
+	for (buddied = 0; buddied <= 1; buddied++) {
+		for_each_possible_cpu(cpu) {
+			do {
+				want = min(nr, ZBUD_EVICT_BATCH);
+				n = 0;
+				local_bh_disable();
+				bl = zbud_budlists_lock(cpu);
+				if (buddied)
+					n = zbud_evict_collect(&bl->buddied,
+							       batch, n, want);
+				else
+					for (i = 0; i < MAX_CHUNK; i++)
+						n = zbud_evict_collect(
+							&bl->unbuddied[i],
+							batch, n, want);
+				/* want budlists unlocked when doing eviction */
+				zbud_budlists_unlock(bl);
+				for (i = 0; i < n; i++) {
+					spin_lock(&batch[i]->lock);
+					zbud_evict_zbpg(batch[i]);
+				}
+				local_bh_enable();
+				if (buddied)
+					zcache_evicted_buddied_pages += n;
+				else
+					zcache_evicted_unbuddied_pages += n;
+				nr -= n;
+				if (nr <= 0)
+					goto out;
+			} while (n == ZBUD_EVICT_BATCH);
 		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
-	}
-
-	/* as a last resort, free buddied pages */
-retry_bud_list:
-	spin_lock_bh(&zbud_budlists_spinlock);
-	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
-		goto out;
-	}
-	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
-		if (unlikely(!spin_trylock(&zbpg->lock)))
-			continue;
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		spin_unlock(&zbud_budlists_spinlock);
-		zcache_evicted_buddied_pages++;
-		/* want budlists unlocked when doing zbpg eviction */
-		zbud_evict_zbpg(zbpg);
-		local_bh_enable();
-		if (--nr <= 0)
-			goto out;
-		goto retry_bud_list;
 	}
-	spin_unlock_bh(&zbud_budlists_spinlock);
 out:
 	return;
 }
 
 static void __init zbud_init(void)
 {
-	int i;
-
-	INIT_LIST_HEAD(&zbud_buddied_list);
+	struct zbud_budlists *bl;
+	int cpu, i;
 
-	for (i = 0; i < NCHUNKS; i++)
-		INIT_LIST_HEAD(&zbud_unbuddied[i].list);
+	for_each_possible_cpu(cpu) {
+		bl = &per_cpu(zbud_budlists, cpu);
+		spin_lock_init(&bl->lock);
+		INIT_LIST_HEAD(&bl->buddied.list);
+		for (i = 0; i < NCHUNKS; i++)
+			INIT_LIST_HEAD(&bl->unbuddied[i].list);
+	}
 }
 
 #ifdef CONFIG_SYSFS
@@ -631,14 +715,53 @@ static void __init zbud_init(void)
  */
 static int zbud_show_unbuddied_list_counts(char *buf)
 {
-	int i;
+	int cpu, i;
+	unsigned count;
 	char *p = buf;
 
-	for (i = 0; i < NCHUNKS; i++)
-		p += sprintf(p, "%u ", zbud_unbuddied[i].count);
+	for (i = 0; i < NCHUNKS; i++) {
+		count = 0;
+		for_each_possible_cpu(cpu)
+			count += per_cpu(zbud_budlists, cpu).unbuddied[i].count;
+		p += sprintf(p, "%u ", count);
+	}
 	return p - buf;
 }
 
+static int zbud_show_buddied_count(char *buf)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu(zbud_budlists, cpu).buddied.count;
+	return sprintf(buf, "%lu\n", count);
+}
+
+/*
+ * Budlists lock statistics summed over all cpus: number of acquisitions,
+ * how many of those had to wait, total and longest hold time in ns.
+ */
+static int zbud_show_budlists_lock_stats(char *buf)
+{
+	unsigned long count = 0, contended = 0;
+	u64 hold_ns = 0, hold_max_ns = 0;
+	struct zbud_budlists *bl;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		bl = &per_cpu(zbud_budlists, cpu);
+		count += bl->lock_count;
+		contended += bl->lock_contended;
+		hold_ns += bl->lock_hold_ns;
+		hold_max_ns = max(hold_max_ns, bl->lock_hold_max_ns);
+	}
+	return sprintf(buf, "acquired:%lu contended:%lu hold_ns:%llu "
+			"max_hold_ns:%llu\n", count, contended,
+			(unsigned long long)hold_ns,
+			(unsigned long long)hold_max_ns);
+}
+
 static int zbud_show_cumul_chunk_counts(char *buf)
 {
 	unsigned long i, chunks = 0, total_chunks = 0, sum_total_chunks = 0;
@@ -1452,7 +1575,6 @@ ZCACHE_SYSFS_RO(failed_pers_puts);
 ZCACHE_SYSFS_RO(zbud_curr_zbytes);
 ZCACHE_SYSFS_RO(zbud_cumul_zpages);
 ZCACHE_SYSFS_RO(zbud_cumul_zbytes);
-ZCACHE_SYSFS_RO(zbud_buddied_count);
 ZCACHE_SYSFS_RO(zbpg_unused_list_count);
 ZCACHE_SYSFS_RO(evicted_raw_pages);
 ZCACHE_SYSFS_RO(evicted_unbuddied_pages);
@@ -1468,6 +1590,10 @@ ZCACHE_SYSFS_RO_ATOMIC(curr_obj_count);
 ZCACHE_SYSFS_RO_ATOMIC(curr_objnode_count);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_buddied_count,
+			zbud_show_buddied_count);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_budlists_lock_stats,
+			zbud_show_budlists_lock_stats);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
 			zbud_show_cumul_chunk_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zv_curr_dist_counts,
@@ -1503,6 +1629,7 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_put_to_flush_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
+	&zcache_zbud_budlists_lock_stats_attr.attr,
 	&zcache_zv_curr_dist_counts_attr.attr,
 	&zcache_zv_cumul_dist_counts_attr.attr,
 	&zcache_zv_max_zsize_attr.attr,
@@ -23,16 +23,23 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
 #include <linux/crypto.h>
 #include <linux/cpu.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
+#include <linux/file.h>
 
 #include "zram_drv.h"
 
@@ -45,32 +52,37 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices = 1;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 /* Cryptographic API features */
 static char *zram_compressor = ZRAM_COMPRESSOR_DEFAULT;
 static struct crypto_comp * __percpu *zram_comp_pcpu_tfms;
 
+/* Optional stronger compressor used by zram_recompress() */
+static char *zram_recomp_compressor;
+static struct crypto_comp * __percpu *zram_recomp_pcpu_tfms;
+
 enum comp_op {
 	ZRAM_COMPOP_COMPRESS,
 	ZRAM_COMPOP_DECOMPRESS
 };
 
-static int zram_comp_op(enum comp_op op, const u8 *src, unsigned int slen,
-			u8 *dst, unsigned int *dlen)
+static int __zram_comp_op(struct crypto_comp * __percpu *tfms,
+			  enum comp_op op, const u8 *src, unsigned int slen,
+			  u8 *dst, unsigned int *dlen)
 {
 	struct crypto_comp *tfm;
 	int ret;
 
-	tfm = *per_cpu_ptr(zram_comp_pcpu_tfms, get_cpu());
+	tfm = *per_cpu_ptr(tfms, get_cpu());
 	switch (op) {
 	case ZRAM_COMPOP_COMPRESS:
 		ret = crypto_comp_compress(tfm, src, slen, dst, dlen);
@@ -86,9 +98,29 @@ static int zram_comp_op(enum comp_op op, const u8 *src, unsigned int slen,
 	return ret;
 }
 
+static int zram_comp_op(enum comp_op op, const u8 *src, unsigned int slen,
+			u8 *dst, unsigned int *dlen)
+{
+	return __zram_comp_op(zram_comp_pcpu_tfms, op, src, slen, dst, dlen);
+}
+
+static int zram_recomp_op(enum comp_op op, const u8 *src, unsigned int slen,
+			  u8 *dst, unsigned int *dlen)
+{
+	return __zram_comp_op(zram_recomp_pcpu_tfms, op, src, slen, dst, dlen);
+}
+
 static int __init zram_comp_init(void)
 {
 	int ret;
+
+	if (zram_recomp_compressor &&
+	    !crypto_has_comp(zram_recomp_compressor, 0, 0)) {
+		pr_info("%s is not available, recompression disabled\n",
+			zram_recomp_compressor);
+		zram_recomp_compressor = NULL;
+	}
+
 	ret = crypto_has_comp(zram_compressor, 0, 0);
 	if (!ret) {
 		pr_info("%s is not available\n", zram_compressor);
@@ -104,6 +136,17 @@ static int __init zram_comp_init(void)
 	if (!zram_comp_pcpu_tfms)
 		return -ENOMEM;
 
+	if (zram_recomp_compressor) {
+		pr_info("using %s for recompression\n",
+			zram_recomp_compressor);
+		zram_recomp_pcpu_tfms = alloc_percpu(struct crypto_comp *);
+		if (!zram_recomp_pcpu_tfms) {
+			free_percpu(zram_comp_pcpu_tfms);
+			zram_comp_pcpu_tfms = NULL;
+			return -ENOMEM;
+		}
+	}
+
 	return 0;
 }
 
@@ -112,12 +155,43 @@ static inline void zram_comp_exit(void)
 	/* free percpu transforms */
 	if (zram_comp_pcpu_tfms)
 		free_percpu(zram_comp_pcpu_tfms);
+	if (zram_recomp_pcpu_tfms)
+		free_percpu(zram_recomp_pcpu_tfms);
 }
 
 
 /* Crypto API features: percpu code */
 #define ZRAM_DSTMEM_ORDER 1
-static DEFINE_PER_CPU(u8 *, zram_dstmem);
+
+/*
+ * Per-cpu compression output buffer. Writers may sleep in zs_malloc()
+ * while the buffer holds their compressed data, so it is owned through
+ * a mutex rather than by disabling preemption.
+ */
+struct zram_dstmem {
+	u8 *buf;
+	struct mutex lock;
+};
+static DEFINE_PER_CPU(struct zram_dstmem, zram_dstmem);
+
+static struct zram_dstmem *zram_get_dstmem(void)
+{
+	struct zram_dstmem *dstmem;
+
+	for (;;) {
+		dstmem = &per_cpu(zram_dstmem, raw_smp_processor_id());
+		mutex_lock(&dstmem->lock);
+		/* Buffer is gone if its cpu went offline meanwhile */
+		if (likely(dstmem->buf))
+			return dstmem;
+		mutex_unlock(&dstmem->lock);
+	}
+}
+
+static void zram_put_dstmem(struct zram_dstmem *dstmem)
+{
+	mutex_unlock(&dstmem->lock);
+}
 
 static int zram_comp_cpu_up(int cpu)
 {
@@ -127,6 +201,18 @@ static int zram_comp_cpu_up(int cpu)
 	if (IS_ERR(tfm))
 		return NOTIFY_BAD;
 	*per_cpu_ptr(zram_comp_pcpu_tfms, cpu) = tfm;
+
+	if (zram_recomp_pcpu_tfms) {
+		struct crypto_comp *rtfm;
+
+		rtfm = crypto_alloc_comp(zram_recomp_compressor, 0, 0);
+		if (IS_ERR(rtfm)) {
+			crypto_free_comp(tfm);
+			*per_cpu_ptr(zram_comp_pcpu_tfms, cpu) = NULL;
+			return NOTIFY_BAD;
+		}
+		*per_cpu_ptr(zram_recomp_pcpu_tfms, cpu) = rtfm;
+	}
 	return NOTIFY_OK;
 }
 
@@ -137,6 +223,12 @@ static void zram_comp_cpu_down(int cpu)
 	tfm = *per_cpu_ptr(zram_comp_pcpu_tfms, cpu);
 	crypto_free_comp(tfm);
 	*per_cpu_ptr(zram_comp_pcpu_tfms, cpu) = NULL;
+
+	if (zram_recomp_pcpu_tfms) {
+		tfm = *per_cpu_ptr(zram_recomp_pcpu_tfms, cpu);
+		crypto_free_comp(tfm);
+		*per_cpu_ptr(zram_recomp_pcpu_tfms, cpu) = NULL;
+	}
 }
 
 static int zram_cpu_notifier(struct notifier_block *nb,
@@ -144,6 +236,7 @@ static int zram_cpu_notifier(struct notifier_block *nb,
 {
 	int ret;
 	int cpu = (long) pcpu;
+	struct zram_dstmem *dstmem = &per_cpu(zram_dstmem, cpu);
 
 	switch (action) {
 	case CPU_UP_PREPARE:
@@ -152,15 +245,23 @@ static int zram_cpu_notifier(struct notifier_block *nb,
 			pr_err("zram: can't allocate compressor xform\n");
 			return ret;
 		}
-		per_cpu(zram_dstmem, cpu) = (void *)__get_free_pages(
+		mutex_lock(&dstmem->lock);
+		dstmem->buf = (void *)__get_free_pages(
 			GFP_KERNEL | __GFP_REPEAT, ZRAM_DSTMEM_ORDER);
+		mutex_unlock(&dstmem->lock);
+		if (!dstmem->buf) {
+			pr_err("zram: can't allocate compression buffer\n");
+			zram_comp_cpu_down(cpu);
+			return NOTIFY_BAD;
+		}
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
 		zram_comp_cpu_down(cpu);
-		free_pages((unsigned long) per_cpu(zram_dstmem, cpu),
-			    ZRAM_DSTMEM_ORDER);
-		per_cpu(zram_dstmem, cpu) = NULL;
+		mutex_lock(&dstmem->lock);
+		free_pages((unsigned long)dstmem->buf, ZRAM_DSTMEM_ORDER);
+		dstmem->buf = NULL;
+		mutex_unlock(&dstmem->lock);
 		break;
 	default:
 		break;
@@ -191,6 +292,9 @@ static int zram_cpu_init(void)
 	int ret;
 	unsigned int cpu;
 
+	for_each_possible_cpu(cpu)
+		mutex_init(&per_cpu(zram_dstmem, cpu).lock);
+
 	ret = register_cpu_notifier(&zram_cpu_notifier_block);
 	if (ret) {
 		pr_err("zram: can't register cpu notifier\n");
@@ -235,6 +339,30 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+static void zram_update_used_max(struct zram *zram, unsigned long pages)
+{
+	unsigned long old_max, cur_max;
+
+	old_max = atomic_long_read(&zram->stats.max_used_pages);
+	do {
+		cur_max = old_max;
+		if (pages <= cur_max)
+			break;
+		old_max = atomic_long_cmpxchg(&zram->stats.max_used_pages,
+					      cur_max, pages);
+	} while (old_max != cur_max);
+}
+
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -253,36 +381,412 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check whether the page consists of a single repeated word and return
+ * that word in *element. Four words are folded per iteration without
+ * data dependent branches so the loop vectorizes (e.g. to NEON).
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	/* Most pages already differ at the last word */
+	if (val != page[PAGE_SIZE / sizeof(*page) - 1])
+		return 0;
+
+	for (pos = 0; pos < PAGE_SIZE / sizeof(*page); pos += 4) {
+		if ((page[pos] ^ val) | (page[pos + 1] ^ val) |
+		    (page[pos + 2] ^ val) | (page[pos + 3] ^ val))
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned int len,
+			   unsigned long value)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (likely(value == 0)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
+/* Deduplication of identical pages */
+static u32 zram_dedup_checksum(void *mem)
+{
+	return jhash2(mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/* Compare page content in mem against an object, buf is scratch space */
+static bool zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			     void *mem, u8 *buf)
+{
+	int ret = 0;
+	size_t clen = PAGE_SIZE;
+	unsigned char *cmem;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	if (entry->size == PAGE_SIZE)
+		buf = cmem;
+	else
+		ret = zram_comp_op(ZRAM_COMPOP_DECOMPRESS, cmem,
+				entry->size, buf, &clen);
+	if (!ret)
+		ret = memcmp(buf, mem, PAGE_SIZE);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return !ret;
+}
+
+/*
+ * Free an object whose last reference was the one zram_dedup_get() held
+ * while comparing it. The page that owned it already dropped out of
+ * pages_stored and of dedup_saved, as if the object was still shared;
+ * account the rest of its freeing here.
+ */
+static void zram_dedup_release(struct zram *zram, struct zram_entry *entry)
+{
+	zs_free(zram->mem_pool, entry->handle);
+
+	if (unlikely(entry->size > max_zpage_size))
+		zram_stat_dec(&zram->stats.bad_compress);
+	if (entry->size <= PAGE_SIZE / 2)
+		zram_stat_dec(&zram->stats.good_compress);
+	zram_stat64_sub(zram, &zram->stats.compr_size, entry->size);
+	zram_stat64_add(zram, &zram->stats.dedup_saved, entry->size);
+
+	kfree(entry);
+}
+
+/*
+ * Look up an object with the same content as mem and take a reference
+ * on it. Returns NULL if there is none.
+ *
+ * Candidates are compared without dedup_lock held, as that may take a
+ * decompression; a reference keeps each of them alive meanwhile.
+ */
+static struct zram_entry *zram_dedup_get(struct zram *zram, void *mem,
+					 u32 checksum, u8 *buf)
+{
+	struct rb_node *node;
+	struct zram_entry *entry = NULL, *next;
+	bool release;
+
+	spin_lock(&zram->dedup_lock);
+	/* Find the leftmost entry with this checksum */
+	node = zram->dedup_root.rb_node;
+	while (node) {
+		struct zram_entry *e = rb_entry(node, struct zram_entry,
+						rb_node);
+
+		if (checksum < e->checksum) {
+			node = node->rb_left;
+		} else if (checksum > e->checksum) {
+			node = node->rb_right;
+		} else {
+			entry = e;
+			node = node->rb_left;
+		}
+	}
+
+	if (entry)
+		entry->refcount++;
+	spin_unlock(&zram->dedup_lock);
+
+	/* Checksum collisions are resolved by comparing content */
+	while (entry) {
+		/* On a match, our reference is the one of the new page */
+		if (zram_dedup_match(zram, entry, mem, buf))
+			break;
+
+		spin_lock(&zram->dedup_lock);
+		next = NULL;
+		node = rb_next(&entry->rb_node);
+		if (node) {
+			next = rb_entry(node, struct zram_entry, rb_node);
+			if (next->checksum == checksum)
+				next->refcount++;
+			else
+				next = NULL;
+		}
+		release = !--entry->refcount;
+		if (release)
+			rb_erase(&entry->rb_node, &zram->dedup_root);
+		spin_unlock(&zram->dedup_lock);
+
+		if (release)
+			zram_dedup_release(zram, entry);
+		entry = next;
+	}
+
+	if (entry) {
+		zram_stat64_inc(zram, &zram->stats.dedup_hits);
+		zram_stat64_add(zram, &zram->stats.dedup_saved, entry->size);
+	}
+	return entry;
+}
+
+static void zram_dedup_insert(struct zram *zram, struct zram_entry *entry)
+{
+	struct rb_node **p = &zram->dedup_root.rb_node;
+	struct rb_node *parent = NULL;
+
+	spin_lock(&zram->dedup_lock);
+	while (*p) {
+		struct zram_entry *e;
+
+		parent = *p;
+		e = rb_entry(parent, struct zram_entry, rb_node);
+		if (entry->checksum < e->checksum)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, p);
+	rb_insert_color(&entry->rb_node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drop a reference to a shared object. Returns the zsmalloc handle to
+ * free once the last reference is gone, zero otherwise.
+ */
+static unsigned long zram_dedup_put(struct zram *zram,
+				    struct zram_entry *entry)
+{
+	unsigned long handle = 0;
+
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		zram_stat64_sub(zram, &zram->stats.dedup_saved, entry->size);
+	} else {
+		rb_erase(&entry->rb_node, &zram->dedup_root);
+		handle = entry->handle;
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	if (handle)
+		kfree(entry);
+	return handle;
+}
+
+/*
+ * Whether the object of a slot is referenced by other slots as well.
+ * Caller must hold the slot lock.
+ */
+static bool zram_slot_shared(struct zram *zram, u32 index)
+{
+	struct zram_entry *entry;
+	bool shared;
+
+	if (!zram_test_flag(zram, index, ZRAM_DEDUP))
+		return false;
+
+	entry = (struct zram_entry *)zram->table[index].handle;
+	spin_lock(&zram->dedup_lock);
+	shared = entry->refcount > 1;
+	spin_unlock(&zram->dedup_lock);
+	return shared;
+}
+
+/* Writeback to a backing device */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	/* Block 0 is never used, so no written back slot has a zero handle */
+	unsigned long blk_idx = 1;
+
+retry:
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx >= zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	zram_stat_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk_idx, zram->bitmap));
+	zram_stat_dec(&zram->stats.bd_count);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronous single page I/O on the backing device */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long blk_idx, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+	return ret;
+}
+
+/*
+ * Reads from the backing device, used on the swap-in path. It needs a
+ * rescuer so the reads make progress when no new worker can be created.
+ */
+static struct workqueue_struct *zram_bdev_wq;
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw;
+
+	zw = container_of(work, struct zram_bdev_work, work);
+	zw->ret = zram_bdev_rw(zw->zram, zw->page, zw->blk_idx, READ_SYNC);
+}
+
+/*
+ * Read a written back page. Bios submitted from our make_request
+ * function are only queued on current->bio_list until it returns, so
+ * waiting for one there would deadlock. Do the I/O from a worker.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long blk_idx)
+{
+	struct zram_bdev_work zw;
+
+	zw.zram = zram;
+	zw.page = page;
+	zw.blk_idx = blk_idx;
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_read_work);
+	queue_work(zram_bdev_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	return zw.ret;
+}
+
+/* Same as zram_read_from_bdev() but into a kernel buffer */
+static int zram_read_from_bdev_buf(struct zram *zram, void *mem,
+				   unsigned long blk_idx)
+{
+	int ret;
+	void *src;
+	struct page *page;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_read_from_bdev(zram, page, blk_idx);
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	}
+
+	__free_page(page);
+	return ret;
+}
+
+/* zsmalloc handle backing a slot. Caller must hold the slot lock */
+static unsigned long zram_slot_handle(struct zram *zram, u32 index)
+{
+	unsigned long handle = zram->table[index].handle;
+
+	if (zram_test_flag(zram, index, ZRAM_SAME))
+		return 0;
+	if (handle && zram_test_flag(zram, index, ZRAM_DEDUP))
+		handle = ((struct zram_entry *)handle)->handle;
+	return handle;
+}
+
+/* Caller must hold the slot lock */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	unsigned long handle = zram->table[index].handle;
 	u16 size = zram->table[index].size;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, handle);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].handle = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same filled pages, the handle
+	 * holds the fill pattern. Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		if (!handle)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].handle = 0;
+		return;
+	}
+
+	if (unlikely(!handle))
 		return;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		handle = zram_dedup_put(zram, (struct zram_entry *)handle);
+		if (!handle) {
+			/* Object is still shared with other pages */
+			zram_stat_dec(&zram->stats.pages_stored);
+			zram->table[index].handle = 0;
+			zram->table[index].size = 0;
+			return;
+		}
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_RECOMP)) {
+		zram_clear_flag(zram, index, ZRAM_RECOMP);
+		zram_stat_dec(&zram->stats.pages_recomp);
 	}
 
 	if (unlikely(size > max_zpage_size))
@@ -301,13 +805,13 @@ static void zram_free_page(struct zram *zram, size_t index)
 	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -318,21 +822,26 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+/* Caller must hold the slot lock */
 static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 {
 	int ret = 0;
 	size_t clen = PAGE_SIZE;
 	unsigned char *cmem;
-	unsigned long handle = zram->table[index].handle;
+	unsigned long handle = zram_slot_handle(zram, index);
 
-	if (!handle || zram_test_flag(zram, index, ZRAM_ZERO)) {
-		memset(mem, 0, PAGE_SIZE);
+	if (!handle) {
+		/* Same filled or unwritten page, the latter reads as zeros */
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].handle);
 		return 0;
 	}
 
 	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 	if (zram->table[index].size == PAGE_SIZE)
 		memcpy(mem, cmem, PAGE_SIZE);
+	else if (zram_test_flag(zram, index, ZRAM_RECOMP))
+		ret = zram_recomp_op(ZRAM_COMPOP_DECOMPRESS, cmem,
+				zram->table[index].size, mem, &clen);
 	else
 		ret = zram_comp_op(ZRAM_COMPOP_DECOMPRESS, cmem,
 				zram->table[index].size, mem, &clen);
@@ -349,52 +858,82 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/* Read the full content of a slot into mem. May sleep */
+static int zram_read_slot(struct zram *zram, char *mem, u32 index)
+{
+	int ret;
+	unsigned long blk_idx;
+
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		blk_idx = zram->table[index].handle;
+		zram_unlock_slot(zram, index);
+		return zram_read_from_bdev_buf(zram, mem, blk_idx);
+	}
+
+	ret = zram_decompress_page(zram, mem, index);
+	zram_unlock_slot(zram, index);
+	return ret;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
 	struct page *page;
-	unsigned char *user_mem, *uncmem = NULL;
+	unsigned long element;
+	unsigned char *user_mem, *uncmem;
 
 	page = bvec->bv_page;
 
-	if (unlikely(!zram->table[index].handle) ||
-			zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
-		return 0;
-	}
-
-	user_mem = kmap_atomic(page);
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-	else
-		uncmem = user_mem;
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+		if (!uncmem) {
+			pr_info("Unable to allocate temp memory\n");
+			return -ENOMEM;
+		}
 
-	if (!uncmem) {
-		pr_info("Unable to allocate temp memory\n");
-		ret = -ENOMEM;
-		goto out_cleanup;
+		ret = zram_read_slot(zram, uncmem, index);
+		if (!ret) {
+			user_mem = kmap_atomic(page);
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+					bvec->bv_len);
+			kunmap_atomic(user_mem);
+			flush_dcache_page(page);
+		}
+		kfree(uncmem);
+		return ret;
 	}
 
-	ret = zram_decompress_page(zram, uncmem, index);
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != 0)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		goto out_cleanup;
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	if (unlikely(!zram->table[index].handle) ||
+			zram_test_flag(zram, index, ZRAM_SAME)) {
+		element = zram->table[index].handle;
+		zram_unlock_slot(zram, index);
+		handle_same_page(bvec, element);
+		return 0;
 	}
 
-	if (is_partial_io(bvec))
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-				bvec->bv_len);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		element = zram->table[index].handle;
+		zram_unlock_slot(zram, index);
+		ret = zram_read_from_bdev(zram, page, element);
+		if (!ret)
+			flush_dcache_page(page);
+		return ret;
+	}
 
-	flush_dcache_page(page);
-	ret = 0;
-out_cleanup:
+	user_mem = kmap_atomic(page);
+	ret = zram_decompress_page(zram, user_mem, index);
+	zram_unlock_slot(zram, index);
 	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-		kfree(uncmem);
+
+	/* Failure was already reported by zram_decompress_page() */
+	if (!ret)
+		flush_dcache_page(page);
 	return ret;
 }
 
@@ -403,36 +942,34 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret = 0;
 	size_t clen;
-	unsigned long handle;
+	u32 checksum = 0;
+	unsigned long handle, element, alloced_pages;
 	struct page *page;
+	struct zram_entry *entry = NULL;
+	struct zram_dstmem *dstmem = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_decompress_page(zram, uncmem, index);
+		ret = zram_read_slot(zram, uncmem, index);
 		if (ret)
 			goto out;
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
+	/* Must be taken before kmap_atomic(): it may sleep */
+	dstmem = zram_get_dstmem();
+	src = dstmem->buf;
 
 	user_mem = kmap_atomic(page);
 
@@ -445,15 +982,43 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = user_mem;
 	}
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		if (!is_partial_io(bvec))
 			kunmap_atomic(user_mem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram->table[index].handle = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_unlock_slot(zram, index);
+		zram_stat_inc(&zram->stats.pages_same);
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
+	if (zram->dedup_enable) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_get(zram, uncmem, checksum, src);
+		if (entry) {
+			if (!is_partial_io(bvec))
+				kunmap_atomic(user_mem);
+			zram_lock_slot(zram, index);
+			zram_free_page(zram, index);
+			zram->table[index].handle = (unsigned long)entry;
+			zram->table[index].size = entry->size;
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+			zram_unlock_slot(zram, index);
+			zram_stat_inc(&zram->stats.pages_stored);
+			ret = 0;
+			goto out;
+		}
+	}
+
 	ret = zram_comp_op(ZRAM_COMPOP_COMPRESS, uncmem,
 			   PAGE_SIZE, src, &clen);
 
@@ -469,7 +1034,6 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	}
 
 	if (unlikely(clen > max_zpage_size)) {
-		zram_stat_inc(&zram->stats.bad_compress);
 		clen = PAGE_SIZE;
 		src = NULL;
 		if (is_partial_io(bvec))
@@ -483,6 +1047,18 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = -ENOMEM;
 		goto out;
 	}
+
+	/*
+	 * Fail the write once the pool grows past the limit instead of
+	 * pushing the system further into reclaim.
+	 */
+	alloced_pages = zs_get_total_pages(zram->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(zram->mem_pool, handle);
+		ret = -ENOMEM;
+		goto out;
+	}
+	zram_update_used_max(zram, alloced_pages);
 	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
 	if ((clen == PAGE_SIZE) && !is_partial_io(bvec))
@@ -493,16 +1069,46 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	zs_unmap_object(zram->mem_pool, handle);
 
-	zram->table[index].handle = handle;
+	zram_put_dstmem(dstmem);
+	dstmem = NULL;
+
+	/* Failing to index the object only loses the dedup opportunity */
+	if (zram->dedup_enable)
+		entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (entry) {
+		entry->handle = handle;
+		entry->checksum = checksum;
+		entry->size = clen;
+		entry->refcount = 1;
+		zram_dedup_insert(zram, entry);
+	}
+
+	/*
+	 * Free memory associated with the previous content of this
+	 * sector and publish the new object.
+	 */
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
+	if (entry) {
+		zram->table[index].handle = (unsigned long)entry;
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zram->table[index].handle = handle;
+	}
 	zram->table[index].size = clen;
+	zram_unlock_slot(zram, index);
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
+	if (unlikely(clen > max_zpage_size))
+		zram_stat_inc(&zram->stats.bad_compress);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
 out:
+	if (dstmem)
+		zram_put_dstmem(dstmem);
 	if (is_partial_io(bvec))
 		kfree(uncmem);
 
@@ -511,20 +1117,337 @@ out:
 	return ret;
 }
 
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	down_read(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB) &&
+		    !zram_test_flag(zram, index, ZRAM_UNDER_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+	}
+out:
+	up_read(&zram->init_lock);
+}
+
+/*
+ * Move pages selected by mode to the backing device. Each page is
+ * decompressed, written out without the slot lock held and only then
+ * swapped for its block index, unless it was accessed meanwhile.
+ */
+int zram_writeback(struct zram *zram, enum zram_select mode)
+{
+	int ret = 0;
+	size_t index;
+	unsigned long blk_idx = 0;
+	struct page *page;
+	void *mem;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	down_read(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (!blk_idx) {
+			blk_idx = zram_alloc_block(zram);
+			if (!blk_idx) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		zram_lock_slot(zram, index);
+		/* Shared objects stay in memory */
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB) ||
+		    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    zram_slot_shared(zram, index))
+			goto next;
+		if (mode == ZRAM_SELECT_HUGE &&
+		    zram->table[index].size != PAGE_SIZE)
+			goto next;
+		if (mode == ZRAM_SELECT_IDLE &&
+		    !zram_test_flag(zram, index, ZRAM_IDLE))
+			goto next;
+
+		/* Any access from now on clears ZRAM_IDLE and cancels us */
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_set_flag(zram, index, ZRAM_IDLE);
+		mem = kmap_atomic(page);
+		ret = zram_decompress_page(zram, mem, index);
+		kunmap_atomic(mem);
+		zram_unlock_slot(zram, index);
+
+		if (!ret)
+			ret = zram_bdev_rw(zram, page, blk_idx, WRITE_SYNC);
+
+		zram_lock_slot(zram, index);
+		if (ret || !zram_test_flag(zram, index, ZRAM_IDLE)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_clear_flag(zram, index, ZRAM_IDLE);
+			ret = 0;
+			goto next;
+		}
+
+		zram_free_page(zram, index);
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].handle = blk_idx;
+		zram->table[index].size = 0;
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+		blk_idx = 0;
+next:
+		zram_unlock_slot(zram, index);
+	}
+
+	if (blk_idx)
+		zram_free_block(zram, blk_idx);
+out:
+	up_read(&zram->init_lock);
+	__free_page(page);
+	return ret;
+}
+
+/*
+ * Try to shrink one slot with the secondary compressor. Like writeback,
+ * the slot is only replaced if it was not accessed meanwhile. Returns
+ * the number of bytes saved.
+ */
+static size_t zram_recompress_slot(struct zram *zram, u32 index,
+				   enum zram_select mode, void *mem, u8 *dst)
+{
+	int ret;
+	size_t clen = PAGE_SIZE * 2, size;
+	unsigned long handle, alloced_pages;
+	unsigned char *cmem;
+
+	zram_lock_slot(zram, index);
+	/* Shared objects stay compressed with the primary compressor */
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+	    zram_test_flag(zram, index, ZRAM_RECOMP) ||
+	    zram_slot_shared(zram, index))
+		goto out;
+	if (mode == ZRAM_SELECT_HUGE && zram->table[index].size != PAGE_SIZE)
+		goto out;
+	if (mode == ZRAM_SELECT_IDLE && !zram_test_flag(zram, index, ZRAM_IDLE))
+		goto out;
+
+	/* Any access from now on clears ZRAM_IDLE and cancels us */
+	zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	zram_set_flag(zram, index, ZRAM_IDLE);
+	size = zram->table[index].size;
+	ret = zram_decompress_page(zram, mem, index);
+	zram_unlock_slot(zram, index);
+
+	if (!ret)
+		ret = zram_recomp_op(ZRAM_COMPOP_COMPRESS, mem, PAGE_SIZE,
+				     dst, &clen);
+	if (ret || clen >= size)
+		goto cancel;
+
+	/* The old object is only freed later, respect the limit meanwhile */
+	if (zram->limit_pages &&
+	    zs_get_total_pages(zram->mem_pool) > zram->limit_pages)
+		goto cancel;
+
+	handle = zs_malloc(zram->mem_pool, clen);
+	if (!handle)
+		goto cancel;
+
+	alloced_pages = zs_get_total_pages(zram->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(zram->mem_pool, handle);
+		goto cancel;
+	}
+	zram_update_used_max(zram, alloced_pages);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, dst, clen);
+	zs_unmap_object(zram->mem_pool, handle);
+
+	zram_lock_slot(zram, index);
+	if (!zram_test_flag(zram, index, ZRAM_IDLE)) {
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_slot(zram, index);
+		zs_free(zram->mem_pool, handle);
+		return 0;
+	}
+
+	zram_free_page(zram, index);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_set_flag(zram, index, ZRAM_RECOMP);
+	zram->table[index].handle = handle;
+	zram->table[index].size = clen;
+	zram_unlock_slot(zram, index);
+
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	zram_stat_inc(&zram->stats.pages_stored);
+	zram_stat_inc(&zram->stats.pages_recomp);
+	if (unlikely(clen > max_zpage_size))
+		zram_stat_inc(&zram->stats.bad_compress);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
+	return size - clen;
+
+cancel:
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+out:
+	zram_unlock_slot(zram, index);
+	return 0;
+}
+
+static void zram_recompress_work(struct work_struct *work)
+{
+	size_t index;
+	u64 saved = 0;
+	void *mem;
+	u8 *dst;
+	struct zram *zram = container_of(work, struct zram, recomp_work);
+
+	mem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	dst = (u8 *)__get_free_pages(GFP_KERNEL, ZRAM_DSTMEM_ORDER);
+	if (!mem || !dst)
+		goto out;
+
+	down_read(&zram->init_lock);
+	for (index = 0; zram->init_done &&
+	     index < zram->disksize >> PAGE_SHIFT; index++) {
+		saved += zram_recompress_slot(zram, index, zram->recomp_mode,
+					      mem, dst);
+		cond_resched();
+	}
+	up_read(&zram->init_lock);
+
+	pr_debug("recompression saved %llu bytes\n", saved);
+out:
+	kfree(mem);
+	free_pages((unsigned long)dst, ZRAM_DSTMEM_ORDER);
+}
+
+/*
+ * Recompress the pages selected by mode with the secondary compressor
+ * in the background, keeping the result only if it is smaller.
+ */
+int zram_recompress(struct zram *zram, enum zram_select mode)
+{
+	if (!zram_recomp_pcpu_tfms)
+		return -EINVAL;
+
+	if (work_pending(&zram->recomp_work))
+		return -EBUSY;
+
+	zram->recomp_mode = mode;
+	queue_work(system_long_wq, &zram->recomp_work);
+	return 0;
+}
+
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	set_blocksize(zram->bdev, zram->old_block_size);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->nr_pages = 0;
+	zram->bitmap = NULL;
+}
+
+/*
+ * Attach a block device for writeback; regular files can be used
+ * through a loop device. Caller holds init_lock for writing and the
+ * device must not be initialized yet.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	struct file *backing_dev;
+	struct inode *inode;
+	struct block_device *bdev;
+	unsigned long nr_pages, *bitmap;
+
+	backing_dev = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out_close;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto out_close;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+
+	zram->old_block_size = block_size(bdev);
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret < 0) {
+		vfree(bitmap);
+		goto out_put;
+	}
+
+	zram_reset_backing_dev(zram);
+	zram->backing_dev = backing_dev;
+	zram->bdev = bdev;
+	zram->nr_pages = nr_pages;
+	zram->bitmap = bitmap;
+	pr_info("setup backing device %s\n", path);
+	return 0;
+
+out_put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out_close:
+	filp_close(backing_dev, NULL);
+	return ret;
+}
+
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 			int offset, struct bio *bio, int rw)
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -536,6 +1459,112 @@ static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
+/* Asynchronous compression of multi-page writes */
+static struct workqueue_struct *zram_async_wq;
+
+struct zram_bio_ctx;
+
+struct zram_bio_work {
+	struct work_struct work;
+	struct zram_bio_ctx *ctx;
+	struct bio_vec *bvec;
+	u32 index;
+};
+
+/* One per bio: completed once every page has been stored */
+struct zram_bio_ctx {
+	struct zram *zram;
+	struct bio *bio;
+	atomic_t pending;
+	atomic_t error;
+	struct zram_bio_work works[0];
+};
+
+static void zram_async_write_work(struct work_struct *work)
+{
+	struct zram_bio_work *bw;
+	struct zram_bio_ctx *ctx;
+	struct zram *zram;
+
+	bw = container_of(work, struct zram_bio_work, work);
+	ctx = bw->ctx;
+	zram = ctx->zram;
+
+	if (zram_bvec_write(zram, bw->bvec, bw->index, 0) < 0)
+		atomic_set(&ctx->error, 1);
+
+	if (!atomic_dec_and_test(&ctx->pending))
+		return;
+
+	if (atomic_read(&ctx->error)) {
+		bio_io_error(ctx->bio);
+	} else {
+		set_bit(BIO_UPTODATE, &ctx->bio->bi_flags);
+		bio_endio(ctx->bio, 0);
+	}
+	kfree(ctx);
+
+	if (atomic_dec_and_test(&zram->async_pending))
+		wake_up(&zram->async_wait);
+}
+
+/*
+ * Spread the pages of a large write over per-cpu workers so they are
+ * compressed in parallel instead of one by one in the submitter, which
+ * for swap is usually kswapd. Only bios made of whole, page aligned
+ * pages are handled; returns false if the caller must do the I/O.
+ */
+static bool zram_make_request_async(struct zram *zram, struct bio *bio)
+{
+	int i, cpu, nr_pages;
+	u32 index;
+	struct bio_vec *bvec;
+	struct zram_bio_ctx *ctx;
+	struct zram_bio_work *bw;
+
+	nr_pages = bio_segments(bio);
+	if (!zram->async_write || nr_pages < 2 ||
+	    (bio->bi_sector & (SECTORS_PER_PAGE - 1)))
+		return false;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (bvec->bv_len != PAGE_SIZE)
+			return false;
+	}
+
+	ctx = kmalloc(sizeof(*ctx) + nr_pages * sizeof(*bw),
+		      GFP_NOIO | __GFP_NOWARN);
+	if (!ctx)
+		return false;
+
+	ctx->zram = zram;
+	ctx->bio = bio;
+	atomic_set(&ctx->error, 0);
+	atomic_set(&ctx->pending, nr_pages);
+	atomic_inc(&zram->async_pending);
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	bw = ctx->works;
+	/* keep the cpus we queue on from going away meanwhile */
+	get_online_cpus();
+	cpu = raw_smp_processor_id();
+	bio_for_each_segment(bvec, bio, i) {
+		bw->ctx = ctx;
+		bw->bvec = bvec;
+		bw->index = index++;
+		INIT_WORK(&bw->work, zram_async_write_work);
+		queue_work_on(cpu, zram_async_wq, &bw->work);
+		bw++;
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+	put_online_cpus();
+
+	return true;
+}
+
 static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 {
 	int i, offset;
@@ -548,6 +1577,8 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 		break;
 	case WRITE:
 		zram_stat64_inc(zram, &zram->stats.num_writes);
+		if (zram_make_request_async(zram, bio))
+			return;
 		break;
 	}
 
@@ -642,28 +1673,37 @@ error:
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
+	struct rb_node *node;
 
 	if (!zram->init_done)
 		return;
 
-	zram->init_done = 0;
-
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* New requests are blocked by init_lock, drain in-flight writes */
+	wait_event(zram->async_wait, !atomic_read(&zram->async_pending));
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram->init_done = 0;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		unsigned long handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_DEDUP) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		zs_free(zram->mem_pool, handle);
 	}
 
+	/* Shared objects are owned by the dedup index */
+	while ((node = rb_first(&zram->dedup_root))) {
+		struct zram_entry *entry;
+
+		entry = rb_entry(node, struct zram_entry, rb_node);
+		rb_erase(node, &zram->dedup_root);
+		zs_free(zram->mem_pool, entry->handle);
+		kfree(entry);
+	}
+
 	vfree(zram->table);
 	zram->table = NULL;
 
@@ -672,6 +1712,7 @@ void __zram_reset_device(struct zram *zram)
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
+	zram->limit_pages = 0;
 
 	zram->disksize = 0;
 	set_capacity(zram->disk, 0);
@@ -679,8 +1720,13 @@ void __zram_reset_device(struct zram *zram)
 
 void zram_reset_device(struct zram *zram)
 {
+	/* The worker takes init_lock itself */
+	cancel_work_sync(&zram->recomp_work);
+
 	down_write(&zram->init_lock);
 	__zram_reset_device(zram);
+	/* The backing device may be attached before the disk is set up */
+	zram_reset_backing_dev(zram);
 	up_write(&zram->init_lock);
 }
 
@@ -710,14 +1756,6 @@ int zram_init_device(struct zram *zram)
 		);
 	}
 
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vzalloc(num_pages * sizeof(*zram->table));
 	if (!zram->table) {
@@ -729,7 +1767,8 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -758,7 +1797,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -771,9 +1812,13 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_root = RB_ROOT;
+	INIT_WORK(&zram->recomp_work, zram_recompress_work);
+	init_waitqueue_head(&zram->async_wait);
+	atomic_set(&zram->async_pending, 0);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -875,11 +1920,24 @@ static int __init zram_init(void)
 		goto free_cpu_comp;
 	}
 
+	zram_async_wq = alloc_workqueue("zram_async",
+			WQ_MEM_RECLAIM | WQ_CPU_INTENSIVE, 0);
+	if (!zram_async_wq) {
+		ret = -ENOMEM;
+		goto free_cpu_comp;
+	}
+
+	zram_bdev_wq = alloc_workqueue("zram_bdev", WQ_MEM_RECLAIM, 0);
+	if (!zram_bdev_wq) {
+		ret = -ENOMEM;
+		goto free_wq;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warn("Unable to get major number\n");
 		ret = -EBUSY;
-		goto free_cpu_comp;
+		goto free_bdev_wq;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -905,6 +1963,10 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_bdev_wq:
+	destroy_workqueue(zram_bdev_wq);
+free_wq:
+	destroy_workqueue(zram_async_wq);
 free_cpu_comp:
 	zram_comp_cpus_down();
 free_comp:
@@ -926,6 +1988,8 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_bdev_wq);
+	destroy_workqueue(zram_async_wq);
 
 	kfree(zram_devices);
 	zram_comp_cpus_down();
@@ -942,6 +2006,9 @@ module_exit(zram_exit);
 module_param_named(compressor, zram_compressor, charp, 0);
 MODULE_PARM_DESC(compressor, "Compressor type");
 
+module_param_named(recomp_compressor, zram_recomp_compressor, charp, 0);
+MODULE_PARM_DESC(recomp_compressor, "Secondary compressor for cold pages");
+
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Nitin Gupta <ngupta@vflare.org>");
 MODULE_DESCRIPTION("Compressed RAM Block Device");
@@ -17,6 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
 
 #include "../zsmalloc/zsmalloc.h"
 
@@ -53,21 +57,48 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is filled with one repeated word, kept in handle */
+	ZRAM_SAME,
+	/* Slot lock: protects handle, size and the other flags */
+	ZRAM_ACCESS,
+	/* handle points to a shared struct zram_entry, not a zs object */
+	ZRAM_DEDUP,
+	/* Page lives on the backing device, handle is its block index */
+	ZRAM_WB,
+	/* Page is being written back or recompressed */
+	ZRAM_UNDER_WB,
+	/* Page was not accessed since the last "idle" marking */
+	ZRAM_IDLE,
+	/* Object was compressed with the secondary compressor */
+	ZRAM_RECOMP,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Deduplicated object. Pages with identical content share one zsmalloc
+ * object through this entry, which is indexed by content checksum in
+ * zram->dedup_root and freed when the last referencing page goes away.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	unsigned long handle;
+	u32 checksum;
+	u16 size;		/* object size (excluding header) */
+	unsigned int refcount;	/* no. of pages sharing this object */
+};
+
+/*
+ * Allocated for each disk page. The entry is protected by the ZRAM_ACCESS
+ * bit lock in flags, so I/O on different pages runs in parallel.
+ */
 struct table {
 	unsigned long handle;
+	unsigned long flags;
 	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __aligned(4);
+};
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
@@ -77,20 +108,36 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 bad_compress;	/* % of pages with compression ratio>=75% */
+	u64 dedup_hits;		/* no. of writes served by an existing object */
+	u64 dedup_saved;	/* compressed bytes not stored due to dedup */
+	u64 bd_reads;		/* no. of pages read from backing device */
+	u64 bd_writes;		/* no. of pages written back */
+	atomic_t bd_count;	/* no. of pages currently on backing device */
+	atomic_t pages_recomp;	/* no. of pages using secondary compressor */
+	atomic_long_t max_used_pages;	/* peak zs_pool size in pages */
+	atomic_t pages_same;	/* no. of same element filled pages */
+	atomic_t pages_zero;	/* no. of those filled with zeros */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t bad_compress;	/* % of pages with compression ratio>=75% */
+};
+
+/* Pages selected by zram_writeback() and zram_recompress() */
+enum zram_select {
+	ZRAM_SELECT_HUGE,	/* stored uncompressed */
+	ZRAM_SELECT_IDLE,	/* not accessed since zram_mark_idle() */
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	spinlock_t dedup_lock;	/* protect dedup_root and entry refcounts */
+	struct rb_root dedup_root;
+	bool dedup_enable;
+	bool async_write;	/* compress multi-page writes in parallel */
+	atomic_t async_pending;	/* bios being written asynchronously */
+	wait_queue_head_t async_wait;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -101,6 +148,22 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/*
+	 * Limit on the memory used by mem_pool, zero means no limit.
+	 * Writes fail with -ENOMEM once it is exceeded.
+	 */
+	unsigned long limit_pages;
+
+	/* Background recompression, see zram_recompress() */
+	struct work_struct recomp_work;
+	enum zram_select recomp_mode;
+
+	/* Backing device for writeback, set up before initialization */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	unsigned long nr_pages;	/* backing device size in pages */
+	unsigned long *bitmap;	/* blocks in use on the backing device */
 
 	struct zram_stats stats;
 };
@@ -113,5 +176,9 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_select mode);
+extern int zram_recompress(struct zram *zram, enum zram_select mode);
 
 #endif
@@ -56,6 +56,18 @@
  *	PG_private: identifies the first component page
  *	PG_private2: identifies the last component page
  *
+ * Handles given out by zs_malloc() do not encode the object location
+ * directly. Each one points to a word, allocated from a slab cache,
+ * which holds the current location of the object. This lets compaction
+ * move objects from sparsely used zspages into fuller ones and free the
+ * emptied zspages without the users of the handles noticing.
+ *
+ * To find the handle of an object while walking a zspage, allocated
+ * objects start with a ZS_HANDLE_SIZE header holding their handle. The
+ * only exception are 'huge' classes, whose zspage is a single page
+ * holding a single object: those never need compaction, so their objects
+ * come without a header.
+ *
  */
 
 #ifdef CONFIG_ZSMALLOC_DEBUG
@@ -77,6 +89,13 @@
 #include <linux/vmalloc.h>
 #include <linux/hardirq.h>
 #include <linux/spinlock.h>
+#include <linux/bit_spinlock.h>
+#include <linux/sched.h>
+#include <linux/shrinker.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/types.h>
 
 #include "zsmalloc.h"
@@ -119,7 +138,21 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+
+/*
+ * The encoded location is shifted left by OBJ_TAG_BITS. In the word a
+ * handle points to, the lowest bit is then free to serve as a lock
+ * (HANDLE_PIN_BIT) keeping the object in place while it is in use. In
+ * the header of an object it tells allocated objects (header holds
+ * handle | OBJ_ALLOCATED_TAG) from free ones (header holds the location
+ * of the next free object).
+ */
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
@@ -173,6 +206,15 @@ enum fullness_group {
  */
 static const int fullness_threshold_frac = 4;
 
+/*
+ * Each cpu keeps up to ZS_MAG_SIZE freed objects per size class, still
+ * allocated along with their handles, and hands them out again without
+ * taking the class lock. ZS_CPU_CACHE_BYTES bounds the memory a cpu
+ * holds this way in one pool.
+ */
+#define ZS_MAG_SIZE		4
+#define ZS_CPU_CACHE_BYTES	(32 * PAGE_SIZE)
+
 struct size_class {
 	/*
 	 * Size of objects stored in this class. Must be multiple
@@ -183,11 +225,18 @@ struct size_class {
 
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int pages_per_zspage;
+	/* Number of objects a zspage of this class can hold */
+	int objs_per_zspage;
+	/* Single object per single-page zspage, stored without header */
+	bool huge;
 
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long objs_allocated;	/* object slots in all zspages */
+	unsigned long objs_inuse;	/* of which in use */
+	unsigned long zspages[_ZS_NR_FULLNESS_GROUPS]; /* on each list */
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -199,16 +248,53 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of allocated object, tagged with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
+};
+
+struct zs_magazine {
+	unsigned int count;
+	unsigned long handles[ZS_MAG_SIZE];
+};
+
+struct zs_cpu_cache {
+	/* only ever contended when another cpu drains the cache */
+	spinlock_t lock;
+	unsigned long bytes;	/* sum of the sizes of cached objects */
+	struct zs_magazine mag[ZS_SIZE_CLASSES];
 };
 
 struct zs_pool {
+	char *name;
+	struct list_head list;	/* on zs_pools, for cpu hotplug */
+
 	struct size_class size_class[ZS_SIZE_CLASSES];
 
 	gfp_t flags;	/* allocation flags used when growing pool */
+	atomic_long_t pages_allocated;	/* sum over all size classes */
+	atomic_long_t pages_compacted;	/* freed by compaction so far */
+
+	struct shrinker shrinker;
+
+	/* indexed by cpu id */
+	struct zs_cpu_cache **cpu_cache;
+
+#ifdef CONFIG_ZSMALLOC_STAT
+	struct dentry *stat_dentry;
+#endif
 };
 
+/* Backing store of the handles given out by zs_malloc() */
+static struct kmem_cache *zs_handle_cachep;
+
+/* All pools, so that caches of a dead cpu can be drained */
+static LIST_HEAD(zs_pools);
+static DEFINE_MUTEX(zs_pools_lock);
+
 /*
  * A zspage's class index and fullness group
  * are encoded in its (first)page->mapping
@@ -237,6 +323,7 @@ struct mapping_area {
 #endif
 	char *vm_addr; /* address of kmap_atomic()'ed pages */
 	enum zs_mapmode vm_mm; /* mapping mode */
+	bool huge; /* mapped object has no header */
 };
 
 
@@ -283,7 +370,8 @@ static int get_size_class_index(int size)
 		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
 				ZS_SIZE_CLASS_DELTA);
 
-	return idx;
+	/* PAGE_SIZE objects plus header go to the last, huge, class */
+	return min_t(int, idx, ZS_SIZE_CLASSES - 1);
 }
 
 static enum fullness_group get_fullness_group(struct page *page)
@@ -322,6 +410,7 @@ static void insert_zspage(struct page *page, struct size_class *class,
 		list_add_tail(&page->lru, &(*head)->lru);
 
 	*head = page;
+	class->zspages[fullness]++;
 }
 
 static void remove_zspage(struct page *page, struct size_class *class,
@@ -343,6 +432,7 @@ static void remove_zspage(struct page *page, struct size_class *class,
 					struct page, lru);
 
 	list_del_init(&page->lru);
+	class->zspages[fullness]--;
 }
 
 static enum fullness_group fix_fullness_group(struct zs_pool *pool,
@@ -430,28 +520,71 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single object location value */
+static void *location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
 		return NULL;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
 
-	return (void *)handle;
+	return (void *)obj;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(unsigned long handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given object location */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	*page = pfn_to_page(handle >> OBJ_INDEX_BITS);
-	*obj_idx = handle & OBJ_INDEX_MASK;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long alloc_handle(struct zs_pool *pool)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cachep,
+				pool->flags & ~__GFP_HIGHMEM);
+}
+
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cachep, (void *)handle);
+}
+
+/* Current object location of a handle, without the pin bit */
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~(1UL << HANDLE_PIN_BIT);
+}
+
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+/*
+ * A pinned handle keeps its object in place: zs_map_object() and
+ * zs_free() pin, compaction only moves objects it managed to pin itself.
+ */
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -528,7 +661,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -539,7 +672,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -593,9 +726,9 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->pages_per_zspage * PAGE_SIZE / class->size;
+	first_page->objects = class->objs_per_zspage;
 
 	error = 0; /* Success */
 
@@ -622,6 +755,574 @@ static struct page *find_get_zspage(struct size_class *class)
 	return page;
 }
 
+/*
+ * Take the first free object off the zspage's freelist and tag it as
+ * allocated to @handle. Called with class->lock held.
+ */
+static unsigned long obj_malloc(struct page *first_page,
+			struct size_class *class, unsigned long handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)kmap_atomic(m_page) +
+					m_offset / sizeof(*link);
+	first_page->freelist = link->next;
+	if (!class->huge)
+		link->handle = handle | OBJ_ALLOCATED_TAG;
+	else
+		memset(link, POISON_INUSE, sizeof(*link));
+	kunmap_atomic(link);
+
+	first_page->inuse++;
+	class->objs_inuse++;
+
+	return obj;
+}
+
+/* Put an object back on its zspage's freelist, class->lock held */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	/* Insert this object in containing zspage's freelist */
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
+							+ f_offset);
+	link->next = first_page->freelist;
+	kunmap_atomic(link);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+}
+
+/* Size class of the object a pinned handle refers to */
+static struct size_class *handle_to_class(struct zs_pool *pool,
+					unsigned long handle)
+{
+	struct page *page;
+	unsigned long obj_idx;
+	unsigned int class_idx;
+	enum fullness_group fg;
+
+	obj_to_location(handle_to_obj(handle), &page, &obj_idx);
+	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
+
+	return &pool->size_class[class_idx];
+}
+
+/* Free the object of a pinned handle, then the handle itself */
+static void __zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct page *first_page, *f_page;
+	unsigned long obj, f_objidx;
+
+	int class_idx;
+	struct size_class *class;
+	enum fullness_group fullness;
+
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+
+	get_zspage_mapping(first_page, &class_idx, &fullness);
+	class = &pool->size_class[class_idx];
+
+	spin_lock(&class->lock);
+	obj_free(class, obj);
+	fullness = fix_fullness_group(pool, first_page);
+
+	if (fullness == ZS_EMPTY) {
+		class->pages_allocated -= class->pages_per_zspage;
+		class->objs_allocated -= class->objs_per_zspage;
+		atomic_long_sub(class->pages_per_zspage,
+				&pool->pages_allocated);
+	}
+
+	spin_unlock(&class->lock);
+	unpin_tag(handle);
+
+	free_handle(handle);
+	if (fullness == ZS_EMPTY)
+		free_zspage(first_page);
+}
+
+/* Take a cached object of @class off this cpu's magazine, if any */
+static unsigned long zs_cache_get(struct zs_pool *pool,
+					struct size_class *class)
+{
+	struct zs_cpu_cache *cache;
+	struct zs_magazine *mag;
+	unsigned long handle = 0;
+
+	cache = pool->cpu_cache[get_cpu()];
+	spin_lock(&cache->lock);
+	mag = &cache->mag[class->index];
+	if (mag->count) {
+		handle = mag->handles[--mag->count];
+		cache->bytes -= class->size;
+	}
+	spin_unlock(&cache->lock);
+	put_cpu();
+
+	return handle;
+}
+
+/* Keep the object of a pinned handle in this cpu's magazine, if room */
+static bool zs_cache_put(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_cpu_cache *cache;
+	struct zs_magazine *mag;
+	struct size_class *class;
+	bool cached = false;
+
+	class = handle_to_class(pool, handle);
+
+	cache = pool->cpu_cache[get_cpu()];
+	spin_lock(&cache->lock);
+	mag = &cache->mag[class->index];
+	if (mag->count < ZS_MAG_SIZE &&
+	    cache->bytes + class->size <= ZS_CPU_CACHE_BYTES) {
+		mag->handles[mag->count++] = handle;
+		cache->bytes += class->size;
+		cached = true;
+	}
+	spin_unlock(&cache->lock);
+	put_cpu();
+
+	return cached;
+}
+
+/*
+ * Really free all objects cached by @cpu. The handles are taken off the
+ * magazine first: zs_free() pins before taking the cache lock, so we
+ * must not pin with the cache lock held.
+ */
+static void zs_drain_cpu_cache(struct zs_pool *pool, int cpu)
+{
+	int i, j, count;
+	unsigned long handles[ZS_MAG_SIZE];
+	struct zs_cpu_cache *cache = pool->cpu_cache[cpu];
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct zs_magazine *mag = &cache->mag[i];
+
+		spin_lock(&cache->lock);
+		count = mag->count;
+		memcpy(handles, mag->handles, count * sizeof(handles[0]));
+		mag->count = 0;
+		cache->bytes -= count * pool->size_class[i].size;
+		spin_unlock(&cache->lock);
+
+		for (j = 0; j < count; j++) {
+			pin_tag(handles[j]);
+			__zs_free(pool, handles[j]);
+		}
+	}
+}
+
+static void zs_drain_caches(struct zs_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		zs_drain_cpu_cache(pool, cpu);
+}
+
+static void zs_free_caches(struct zs_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(pool->cpu_cache[cpu]);
+	kfree(pool->cpu_cache);
+}
+
+static int zs_alloc_caches(struct zs_pool *pool)
+{
+	int cpu;
+
+	pool->cpu_cache = kcalloc(nr_cpu_ids, sizeof(*pool->cpu_cache),
+					GFP_KERNEL);
+	if (!pool->cpu_cache)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_cpu_cache *cache;
+
+		cache = kzalloc_node(sizeof(*cache), GFP_KERNEL,
+					cpu_to_node(cpu));
+		if (!cache) {
+			zs_free_caches(pool);
+			return -ENOMEM;
+		}
+		spin_lock_init(&cache->lock);
+		pool->cpu_cache[cpu] = cache;
+	}
+
+	return 0;
+}
+
+/* Copy a whole object, header included; either side may span two pages */
+static void zs_object_copy(unsigned long src, unsigned long dst,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	s_size = d_size = class->size;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* atomic kmaps must be dropped in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		} else if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Find the first allocated object starting in @page at or after object
+ * *@index whose handle we can pin. Objects pinned by someone else, i.e.
+ * mapped or being freed, are skipped. Returns the pinned handle and
+ * leaves *@index on its object, or returns 0.
+ */
+static unsigned long find_alloced_obj(struct page *page, int *index,
+					struct size_class *class)
+{
+	unsigned long head, handle = 0;
+	unsigned long offset = 0;
+	void *addr;
+
+	if (!is_first_page(page))
+		offset = page->index;
+	offset += class->size * *index;
+
+	addr = kmap_atomic(page);
+	while (offset < PAGE_SIZE) {
+		head = ((struct link_free *)(addr + offset))->handle;
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			if (trypin_tag(handle))
+				break;
+			handle = 0;
+		}
+		offset += class->size;
+		(*index)++;
+	}
+	kunmap_atomic(addr);
+
+	return handle;
+}
+
+struct zs_compact_control {
+	/* Component page of the source zspage being scanned */
+	struct page *s_page;
+	/* Index of the next object to look at within s_page */
+	int index;
+	/* First page of the destination zspage */
+	struct page *d_page;
+};
+
+/*
+ * Move objects from the source zspage into the destination one until
+ * either the source has no movable objects left (returns 0) or the
+ * destination is full (returns -ENOMEM).
+ */
+static int migrate_zspage(struct size_class *class,
+				struct zs_compact_control *cc)
+{
+	unsigned long used_obj, free_obj, handle;
+	struct page *s_page = cc->s_page;
+	struct page *d_page = cc->d_page;
+	int index = cc->index;
+	int ret = 0;
+
+	while (1) {
+		handle = find_alloced_obj(s_page, &index, class);
+		if (!handle) {
+			s_page = get_next_page(s_page);
+			if (!s_page)
+				break;
+			index = 0;
+			continue;
+		}
+
+		if (d_page->inuse == d_page->objects) {
+			unpin_tag(handle);
+			ret = -ENOMEM;
+			break;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(d_page, class, handle);
+		zs_object_copy(used_obj, free_obj, class);
+		index++;
+		/* keep the pin bit set for unpin_tag() */
+		record_obj(handle, free_obj | (1UL << HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	/* Remember where to continue with the next destination */
+	cc->s_page = s_page;
+	cc->index = index;
+
+	return ret;
+}
+
+/*
+ * Zspages being compacted are taken off their fullness list, so the
+ * source is never picked as a destination. They are put back before
+ * class->lock is dropped.
+ */
+static struct page *isolate_source_page(struct size_class *class)
+{
+	struct page *page = class->fullness_list[ZS_ALMOST_EMPTY];
+
+	if (page)
+		remove_zspage(page, class, ZS_ALMOST_EMPTY);
+
+	return page;
+}
+
+/* Fuller zspages first, so that objects end up packed together */
+static struct page *isolate_target_page(struct size_class *class)
+{
+	int i;
+	struct page *page = NULL;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		page = class->fullness_list[i];
+		if (page) {
+			remove_zspage(page, class, i);
+			break;
+		}
+	}
+
+	return page;
+}
+
+/*
+ * Put an isolated zspage back on the list matching its new fullness, or
+ * free it if it was emptied. Returns the number of pages freed.
+ */
+static int putback_zspage(struct zs_pool *pool, struct size_class *class,
+				struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	if (fullness != ZS_EMPTY)
+		return 0;
+
+	class->pages_allocated -= class->pages_per_zspage;
+	class->objs_allocated -= class->objs_per_zspage;
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+	free_zspage(first_page);
+
+	return class->pages_per_zspage;
+}
+
+/*
+ * Number of pages compacting the class could free at best: the free
+ * object slots, counted in whole zspages. Called with class->lock held.
+ */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->objs_allocated - class->objs_inuse;
+	obj_wasted /= class->objs_per_zspage;
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+/*
+ * Compact one class until about 'budget' pages were freed. Returns the
+ * number of pages freed.
+ */
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class, unsigned long budget)
+{
+	struct zs_compact_control cc;
+	struct page *src_page, *dst_page;
+	unsigned long nr_freed = 0;
+	int freed;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class)) {
+		src_page = isolate_source_page(class);
+		if (!src_page)
+			break;
+
+		cc.s_page = src_page;
+		cc.index = 0;
+
+		while ((dst_page = isolate_target_page(class))) {
+			cc.d_page = dst_page;
+			if (!migrate_zspage(class, &cc))
+				break;
+			/* destination is full, try the next one */
+			putback_zspage(pool, class, dst_page);
+		}
+
+		if (dst_page)
+			putback_zspage(pool, class, dst_page);
+		freed = putback_zspage(pool, class, src_page);
+		nr_freed += freed;
+
+		/*
+		 * Stop when out of destinations, or when the source kept
+		 * pinned objects: it is back at the head of its list and
+		 * would be picked again right away.
+		 */
+		if (!dst_page || !freed || nr_freed >= budget)
+			break;
+
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return nr_freed;
+}
+
+/**
+ * zs_compact - free sparsely used zspages by moving their objects
+ * @pool: pool to compact
+ *
+ * In each size class, objects are migrated out of almost empty zspages
+ * into fuller ones, and the zspages emptied this way are freed. Objects
+ * mapped at the time are left in place. Objects kept in the per-cpu
+ * caches are freed first. May sleep.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long nr_freed = 0;
+
+	/* cached objects would keep their zspages alive */
+	zs_drain_caches(pool);
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		nr_freed += __zs_compact(pool, &pool->size_class[i], ULONG_MAX);
+
+	atomic_long_add(nr_freed, &pool->pages_compacted);
+
+	return nr_freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		pages += zs_can_compact(class);
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+
+/*
+ * Lets reclaim compact the pool. The objects reported to the VM are the
+ * pages compaction could free, and a scan request frees up to
+ * nr_to_scan of them. Unlike zs_compact(), the per-cpu caches are left
+ * alone: they are refilled right away by the next writes.
+ */
+static int zs_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+	unsigned long nr_freed = 0;
+	int i;
+
+	/* compaction may sleep */
+	if (sc->nr_to_scan && (sc->gfp_mask & __GFP_WAIT)) {
+		for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+			nr_freed += __zs_compact(pool, &pool->size_class[i],
+						 sc->nr_to_scan - nr_freed);
+			if (nr_freed >= sc->nr_to_scan)
+				break;
+		}
+		atomic_long_add(nr_freed, &pool->pages_compacted);
+	}
+
+	return min_t(unsigned long, zs_compactable_pages(pool), INT_MAX);
+}
+
 #ifdef USE_PGTABLE_MAPPING
 static inline int __zs_cpu_up(struct mapping_area *area)
 {
@@ -722,6 +1423,13 @@ static void __zs_unmap_object(struct mapping_area *area,
 	if (area->vm_mm == ZS_MM_RO)
 		goto out;
 
+	/* the header was not handed out, don't write it back */
+	if (!area->huge) {
+		buf += ZS_HANDLE_SIZE;
+		size -= ZS_HANDLE_SIZE;
+		off += ZS_HANDLE_SIZE;
+	}
+
 	sizes[0] = PAGE_SIZE - off;
 	sizes[1] = size - sizes[0];
 
@@ -740,6 +1448,17 @@ out:
 
 #endif /* USE_PGTABLE_MAPPING */
 
+/* Give back the objects a cpu going offline still holds */
+static void zs_drain_pools(int cpu)
+{
+	struct zs_pool *pool;
+
+	mutex_lock(&zs_pools_lock);
+	list_for_each_entry(pool, &zs_pools, list)
+		zs_drain_cpu_cache(pool, cpu);
+	mutex_unlock(&zs_pools_lock);
+}
+
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
 {
@@ -757,6 +1476,7 @@ static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 	case CPU_UP_CANCELED:
 		area = &per_cpu(zs_map_area, cpu);
 		__zs_cpu_down(area);
+		zs_drain_pools(cpu);
 		break;
 	}
 
@@ -767,6 +1487,128 @@ static struct notifier_block zs_cpu_nb = {
 	.notifier_call = zs_cpu_notifier
 };
 
+#ifdef CONFIG_ZSMALLOC_STAT
+
+static struct dentry *zs_stat_root;
+
+static void zs_stat_init(void)
+{
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	if (!zs_stat_root)
+		pr_warn("zsmalloc: debugfs stat dir creation failed\n");
+}
+
+static void zs_stat_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+	zs_stat_root = NULL;
+}
+
+static int zs_stats_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+	unsigned long almost_full, almost_empty, full, freeable;
+	unsigned long obj_allocated, obj_used, zspages, pages_used;
+	unsigned long total_almost_full = 0, total_almost_empty = 0;
+	unsigned long total_full = 0, total_freeable = 0;
+	unsigned long total_obj_allocated = 0, total_obj_used = 0;
+	unsigned long total_pages_used = 0;
+
+	seq_printf(s, " %5s %5s %11s %12s %8s %13s %10s %10s %8s %9s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"full", "obj_allocated", "obj_used", "pages_used",
+			"freeable", "pages_per");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		almost_full = class->zspages[ZS_ALMOST_FULL];
+		almost_empty = class->zspages[ZS_ALMOST_EMPTY];
+		obj_allocated = class->objs_allocated;
+		obj_used = class->objs_inuse;
+		freeable = zs_can_compact(class);
+		spin_unlock(&class->lock);
+
+		/* empty zspages are freed right away, the rest is full */
+		zspages = obj_allocated / class->objs_per_zspage;
+		full = zspages - almost_full - almost_empty;
+		pages_used = zspages * class->pages_per_zspage;
+
+		seq_printf(s, " %5d %5d %11lu %12lu %8lu %13lu %10lu %10lu"
+				" %8lu %9d\n",
+				i, class->size, almost_full, almost_empty,
+				full, obj_allocated, obj_used, pages_used,
+				freeable, class->pages_per_zspage);
+
+		total_almost_full += almost_full;
+		total_almost_empty += almost_empty;
+		total_full += full;
+		total_obj_allocated += obj_allocated;
+		total_obj_used += obj_used;
+		total_pages_used += pages_used;
+		total_freeable += freeable;
+	}
+
+	seq_puts(s, "\n");
+	seq_printf(s, " %5s %5s %11lu %12lu %8lu %13lu %10lu %10lu %8lu\n",
+			"Total", "", total_almost_full, total_almost_empty,
+			total_full, total_obj_allocated, total_obj_used,
+			total_pages_used, total_freeable);
+
+	return 0;
+}
+
+static int zs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_stat_fops = {
+	.open		= zs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_stat_root)
+		return;
+
+	pool->stat_dentry = debugfs_create_file(pool->name, S_IRUGO,
+					zs_stat_root, pool, &zs_stat_fops);
+	if (!pool->stat_dentry)
+		pr_warn("zsmalloc: debugfs stat file for %s not created\n",
+			pool->name);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove(pool->stat_dentry);
+}
+
+#else /* CONFIG_ZSMALLOC_STAT */
+
+static inline void zs_stat_init(void)
+{
+}
+
+static inline void zs_stat_exit(void)
+{
+}
+
+static inline void zs_pool_stat_create(struct zs_pool *pool)
+{
+}
+
+static inline void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+}
+
+#endif /* CONFIG_ZSMALLOC_STAT */
+
 static void zs_exit(void)
 {
 	int cpu;
@@ -774,12 +1616,23 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	zs_stat_exit();
+	if (zs_handle_cachep)
+		kmem_cache_destroy(zs_handle_cachep);
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+						0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	zs_stat_init();
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -794,6 +1647,7 @@ fail:
 
 /**
  * zs_create_pool - Creates an allocation pool to work from.
+ * @name: name of the pool, used for its statistics
  * @flags: allocation flags used to allocate pool metadata
  *
  * This function must be called before anything when using
@@ -802,7 +1656,7 @@ fail:
  * On success, a pointer to the newly created pool is returned,
  * otherwise NULL.
  */
-struct zs_pool *zs_create_pool(gfp_t flags)
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 {
 	int i, ovhd_size;
 	struct zs_pool *pool;
@@ -812,6 +1666,18 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 	if (!pool)
 		return NULL;
 
+	pool->name = kstrdup(name, GFP_KERNEL);
+	if (!pool->name) {
+		kfree(pool);
+		return NULL;
+	}
+
+	if (zs_alloc_caches(pool)) {
+		kfree(pool->name);
+		kfree(pool);
+		return NULL;
+	}
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int size;
 		struct size_class *class;
@@ -825,11 +1691,24 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->pages_per_zspage = get_pages_per_zspage(size);
-
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / size;
+		class->huge = class->pages_per_zspage == 1 &&
+				class->objs_per_zspage == 1;
 	}
 
 	pool->flags = flags;
 
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	mutex_lock(&zs_pools_lock);
+	list_add(&pool->list, &zs_pools);
+	mutex_unlock(&zs_pools_lock);
+
+	zs_pool_stat_create(pool);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -838,6 +1717,16 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	zs_pool_stat_destroy(pool);
+	unregister_shrinker(&pool->shrinker);
+
+	mutex_lock(&zs_pools_lock);
+	list_del(&pool->list);
+	mutex_unlock(&zs_pools_lock);
+
+	zs_drain_caches(pool);
+	zs_free_caches(pool);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -850,6 +1739,7 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	kfree(pool->name);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
@@ -865,93 +1755,69 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  */
 unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 {
-	unsigned long obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
-
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	struct page *first_page;
 
 	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
 		return 0;
 
-	class_idx = get_size_class_index(size);
+	/* extra space in the object to keep its handle */
+	class_idx = get_size_class_index(size + ZS_HANDLE_SIZE);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
+	handle = zs_cache_get(pool, class);
+	if (handle)
+		return handle;
+
+	handle = alloc_handle(pool);
+	if (unlikely(!handle))
+		return 0;
+
 	spin_lock(&class->lock);
 	first_page = find_get_zspage(class);
 
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			free_handle(handle);
 			return 0;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->pages_per_zspage;
+		class->objs_allocated += class->objs_per_zspage;
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
 	}
 
-	obj = (unsigned long)first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(first_page, class, handle);
+	/* compaction may look the handle up as soon as the lock is dropped */
+	record_obj(handle, obj);
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, unsigned long obj)
+void zs_free(struct zs_pool *pool, unsigned long handle)
 {
-	struct link_free *link;
-	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
-
-	int class_idx;
-	struct size_class *class;
-	enum fullness_group fullness;
-
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
-	first_page = get_first_page(f_page);
-
-	get_zspage_mapping(first_page, &class_idx, &fullness);
-	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
-
-	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = (void *)obj;
-
-	first_page->inuse--;
-	fullness = fix_fullness_group(pool, first_page);
-
-	if (fullness == ZS_EMPTY)
-		class->pages_allocated -= class->pages_per_zspage;
-
-	spin_unlock(&class->lock);
+	pin_tag(handle);
+	if (zs_cache_put(pool, handle)) {
+		unpin_tag(handle);
+		return;
+	}
 
-	if (fullness == ZS_EMPTY)
-		free_zspage(first_page);
+	__zs_free(pool, handle);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
@@ -965,7 +1831,7 @@ EXPORT_SYMBOL_GPL(zs_free);
  * zs_unmap_object.
  *
  * Only one object can be mapped per cpu at a time. There is no protection
- * against nested mappings.
+ * against nested mappings. A mapped object is not moved by compaction.
  *
  * This function returns with preemption and page faults disabled.
 */
@@ -973,13 +1839,14 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 			enum zs_mapmode mm)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
 	struct page *pages[2];
+	void *ret;
 
 	BUG_ON(!handle);
 
@@ -990,17 +1857,23 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	 */
 	BUG_ON(in_interrupt());
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/* From now on, compaction cannot move the object */
+	pin_tag(handle);
+
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &get_cpu_var(zs_map_area);
 	area->vm_mm = mm;
+	area->huge = class->huge;
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-		return area->vm_addr + off;
+		ret = area->vm_addr + off;
+		goto out;
 	}
 
 	/* this object spans two pages */
@@ -1008,14 +1881,19 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	pages[1] = get_next_page(page);
 	BUG_ON(!pages[1]);
 
-	return __zs_map_object(area, pages, off, class->size);
+	ret = __zs_map_object(area, pages, off, class->size);
+out:
+	if (!class->huge)
+		ret += ZS_HANDLE_SIZE;
+
+	return ret;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -1024,7 +1902,8 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -1042,21 +1921,35 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 		__zs_unmap_object(area, pages, off, class->size);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
-u64 zs_get_total_size_bytes(struct zs_pool *pool)
+/**
+ * zs_get_total_pages - number of pages backing the pool
+ * @pool: pool to query
+ *
+ * Cheap enough to be called after every allocation, e.g. to enforce
+ * a memory limit.
+ */
+unsigned long zs_get_total_pages(struct zs_pool *pool)
 {
-	int i;
-	u64 npages = 0;
-
-	for (i = 0; i < ZS_SIZE_CLASSES; i++)
-		npages += pool->size_class[i].pages_allocated;
+	return atomic_long_read(&pool->pages_allocated);
+}
+EXPORT_SYMBOL_GPL(zs_get_total_pages);
 
-	return npages << PAGE_SHIFT;
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)zs_get_total_pages(pool) << PAGE_SHIFT;
 }
 EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
 
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
 module_init(zs_init);
 module_exit(zs_exit);
 
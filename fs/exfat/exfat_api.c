@@ -96,11 +96,7 @@ int FsMountVol(struct super_block *sb)
 
 	sm_P(&z_sem);
 
-	err = buf_init(sb);
-	if (!err)
-		err = ffsMountVol(sb);
-	else
-		buf_shutdown(sb);
+	err = ffsMountVol(sb);
 
 	sm_V(&z_sem);
 
@@ -116,13 +112,13 @@ int FsUmountVol(struct super_block *sb)
 	sm_P(&z_sem);
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsUmountVol(sb);
 	buf_shutdown(sb);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	sm_V(&z_sem);
 
@@ -140,12 +136,12 @@ int FsGetVolInfo(struct super_block *sb, VOL_INFO_T *info)
 		return FFS_ERROR;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsGetVolInfo(sb, info);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsGetVolInfo */
@@ -157,12 +153,12 @@ int FsSyncVol(struct super_block *sb, int do_sync)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsSyncVol(sb, do_sync);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsSyncVol */
@@ -184,12 +180,12 @@ int FsLookupFile(struct inode *inode, char *path, FILE_ID_T *fid)
 		return FFS_ERROR;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsLookupFile(inode, path, fid);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsLookupFile */
@@ -206,12 +202,12 @@ int FsCreateFile(struct inode *inode, char *path, u8 mode, FILE_ID_T *fid)
 		return FFS_ERROR;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsCreateFile(inode, path, mode, fid);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsCreateFile */
@@ -231,12 +227,12 @@ int FsReadFile(struct inode *inode, FILE_ID_T *fid, void *buffer, u64 count, u64
 		return FFS_ERROR;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsReadFile(inode, fid, buffer, count, rcount);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsReadFile */
@@ -256,12 +252,12 @@ int FsWriteFile(struct inode *inode, FILE_ID_T *fid, void *buffer, u64 count, u6
 		return FFS_ERROR;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsWriteFile(inode, fid, buffer, count, wcount);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsWriteFile */
@@ -274,7 +270,7 @@ int FsTruncateFile(struct inode *inode, u64 old_size, u64 new_size)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	DPRINTK("FsTruncateFile entered (inode %p size %llu)\n", inode, new_size);
 
@@ -283,7 +279,7 @@ int FsTruncateFile(struct inode *inode, u64 old_size, u64 new_size)
 	DPRINTK("FsTruncateFile exitted (%d)\n", err);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsTruncateFile */
@@ -300,12 +296,12 @@ int FsMoveFile(struct inode *old_parent_inode, FILE_ID_T *fid, struct inode *new
 		return FFS_INVALIDFID;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsMoveFile(old_parent_inode, fid, new_parent_inode, new_dentry);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsMoveFile */
@@ -322,12 +318,12 @@ int FsRemoveFile(struct inode *inode, FILE_ID_T *fid)
 		return FFS_INVALIDFID;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsRemoveFile(inode, fid);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsRemoveFile */
@@ -340,12 +336,12 @@ int FsSetAttr(struct inode *inode, u32 attr)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsSetAttr(inode, attr);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsSetAttr */
@@ -358,12 +354,12 @@ int FsReadStat(struct inode *inode, DIR_ENTRY_T *info)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsGetStat(inode, info);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsReadStat */
@@ -376,38 +372,54 @@ int FsWriteStat(struct inode *inode, DIR_ENTRY_T *info)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	DPRINTK("FsWriteStat entered (inode %p info %p\n", inode, info);
 
 	err = ffsSetStat(inode, info);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	DPRINTK("FsWriteStat exited (%d)\n", err);
 
 	return err;
 } /* end of FsWriteStat */
 
-/* FsMapCluster : return the cluster number in the given cluster offset */
-int FsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
+/* FsMapCluster : return the cluster number in the given cluster offset,
+   and in clu_count how many clusters are contiguous from there */
+int FsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu, u32 *clu_count)
 {
 	int err;
+	u32 max_count;
 	struct super_block *sb = inode->i_sb;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	/* check the validity of pointer parameters */
-	if (clu == NULL)
+	if ((clu == NULL) || (clu_count == NULL))
 		return FFS_ERROR;
 
+	max_count = *clu_count;
+
+	/* looking up clusters that are already allocated only reads the
+	   FAT, so it may run alongside other lookups */
+	rwsm_P_read(&p_fs->v_sem);
+
+	err = ffsMapCluster(inode, clu_offset, clu, clu_count, FALSE);
+
+	rwsm_V_read(&p_fs->v_sem);
+
+	if (err || (*clu != CLUSTER_32(~0)))
+		return err;
+
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
-	err = ffsMapCluster(inode, clu_offset, clu);
+	*clu_count = max_count;
+	err = ffsMapCluster(inode, clu_offset, clu, clu_count, TRUE);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsMapCluster */
@@ -428,12 +440,12 @@ int FsCreateDir(struct inode *inode, char *path, FILE_ID_T *fid)
 		return FFS_ERROR;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsCreateDir(inode, path, fid);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsCreateDir */
@@ -450,12 +462,12 @@ int FsReadDir(struct inode *inode, DIR_ENTRY_T *dir_entry)
 		return FFS_ERROR;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsReadDir(inode, dir_entry);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsReadDir */
@@ -472,12 +484,12 @@ int FsRemoveDir(struct inode *inode, FILE_ID_T *fid)
 		return FFS_INVALIDFID;
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	err = ffsRemoveDir(inode, fid);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return err;
 } /* end of FsRemoveDir */
@@ -508,13 +520,13 @@ int FsReleaseCache(struct super_block *sb)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	rwsm_P_write(&p_fs->v_sem);
 
 	FAT_release_all(sb);
 	buf_release_all(sb);
 
 	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	rwsm_V_write(&p_fs->v_sem);
 
 	return 0;
 }
@@ -193,7 +193,7 @@ typedef struct {
 	int FsSetAttr(struct inode *inode, u32 attr);
 	int FsReadStat(struct inode *inode, DIR_ENTRY_T *info);
 	int FsWriteStat(struct inode *inode, DIR_ENTRY_T *info);
-	int FsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu);
+	int FsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu, u32 *clu_count);
 
 /* directory management functions */
 	int FsCreateDir(struct inode *inode, char *path, FILE_ID_T *fid);
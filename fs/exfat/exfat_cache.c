@@ -33,6 +33,12 @@
 /*                                                                      */
 /************************************************************************/
 
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+
 #include "exfat_config.h"
 #include "exfat_data.h"
 
@@ -44,9 +50,6 @@
 /*  Global Variable Definitions                                         */
 /*----------------------------------------------------------------------*/
 
-#define sm_P(s)
-#define sm_V(s)
-
 static s32 __FAT_read(struct super_block *sb, u32 loc, u32 *content);
 static s32 __FAT_write(struct super_block *sb, u32 loc, u32 content);
 
@@ -71,16 +74,61 @@ static void move_to_lru(BUF_CACHE_T *bp, BUF_CACHE_T *list);
 /*  Cache Initialization Functions                                      */
 /*======================================================================*/
 
+/*
+ * The caches only keep references to buffers of the block device, whose
+ * page cache still holds the data once an entry is evicted from here.
+ * They are sized after the volume, so that the whole FAT of most cards
+ * stays referenced and large directory scans do not keep recycling the
+ * same few entries.
+ */
+static BUF_CACHE_T *buf_cache_alloc(u32 size, u32 hash_size)
+{
+	BUF_CACHE_T *array;
+
+	array = vmalloc((size + hash_size) * sizeof(BUF_CACHE_T));
+	if (array)
+		memset(array, 0, (size + hash_size) * sizeof(BUF_CACHE_T));
+	return array;
+} /* end of buf_cache_alloc */
+
 s32 buf_init(struct super_block *sb)
 {
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
-
+	u32 size, hash_size;
 	int i;
 
+	sm_init(&p_fs->FAT_cache_sem);
+	sm_init(&p_fs->buf_cache_sem);
+
+	/* the FAT cache holds up to the whole FAT */
+	size = roundup_pow_of_two(max_t(u32, p_fs->num_FAT_sectors, 1));
+	size = clamp_t(u32, size, FAT_CACHE_SIZE, FAT_CACHE_MAX_SIZE);
+	hash_size = size >> 1;
+
+	p_fs->FAT_cache_array = buf_cache_alloc(size, hash_size);
+	if (!p_fs->FAT_cache_array)
+		return FFS_MEMORYERR;
+	p_fs->FAT_cache_hash_list = p_fs->FAT_cache_array + size;
+	p_fs->FAT_cache_size = size;
+	p_fs->FAT_cache_hash_mask = hash_size - 1;
+	p_fs->FAT_ra_start = p_fs->FAT_ra_end = 0;
+
+	/* the buf cache grows with the number of clusters */
+	size = roundup_pow_of_two(max_t(u32, p_fs->num_clusters >> 8, 1));
+	size = clamp_t(u32, size, BUF_CACHE_SIZE, BUF_CACHE_MAX_SIZE);
+	hash_size = size >> 2;
+
+	p_fs->buf_cache_array = buf_cache_alloc(size, hash_size);
+	if (!p_fs->buf_cache_array)
+		return FFS_MEMORYERR;
+	p_fs->buf_cache_hash_list = p_fs->buf_cache_array + size;
+	p_fs->buf_cache_size = size;
+	p_fs->buf_cache_hash_mask = hash_size - 1;
+
 	/* LRU list */
 	p_fs->FAT_cache_lru_list.next = p_fs->FAT_cache_lru_list.prev = &p_fs->FAT_cache_lru_list;
 
-	for (i = 0; i < FAT_CACHE_SIZE; i++) {
+	for (i = 0; i < p_fs->FAT_cache_size; i++) {
 		p_fs->FAT_cache_array[i].drv = -1;
 		p_fs->FAT_cache_array[i].sec = ~0;
 		p_fs->FAT_cache_array[i].flag = 0;
@@ -91,7 +139,7 @@ s32 buf_init(struct super_block *sb)
 
 	p_fs->buf_cache_lru_list.next = p_fs->buf_cache_lru_list.prev = &p_fs->buf_cache_lru_list;
 
-	for (i = 0; i < BUF_CACHE_SIZE; i++) {
+	for (i = 0; i < p_fs->buf_cache_size; i++) {
 		p_fs->buf_cache_array[i].drv = -1;
 		p_fs->buf_cache_array[i].sec = ~0;
 		p_fs->buf_cache_array[i].flag = 0;
@@ -101,22 +149,22 @@ s32 buf_init(struct super_block *sb)
 	}
 
 	/* HASH list */
-	for (i = 0; i < FAT_CACHE_HASH_SIZE; i++) {
+	for (i = 0; i <= p_fs->FAT_cache_hash_mask; i++) {
 		p_fs->FAT_cache_hash_list[i].drv = -1;
 		p_fs->FAT_cache_hash_list[i].sec = ~0;
 		p_fs->FAT_cache_hash_list[i].hash_next = p_fs->FAT_cache_hash_list[i].hash_prev = &(p_fs->FAT_cache_hash_list[i]);
 	}
 
-	for (i = 0; i < FAT_CACHE_SIZE; i++)
+	for (i = 0; i < p_fs->FAT_cache_size; i++)
 		FAT_cache_insert_hash(sb, &(p_fs->FAT_cache_array[i]));
 
-	for (i = 0; i < BUF_CACHE_HASH_SIZE; i++) {
+	for (i = 0; i <= p_fs->buf_cache_hash_mask; i++) {
 		p_fs->buf_cache_hash_list[i].drv = -1;
 		p_fs->buf_cache_hash_list[i].sec = ~0;
 		p_fs->buf_cache_hash_list[i].hash_next = p_fs->buf_cache_hash_list[i].hash_prev = &(p_fs->buf_cache_hash_list[i]);
 	}
 
-	for (i = 0; i < BUF_CACHE_SIZE; i++)
+	for (i = 0; i < p_fs->buf_cache_size; i++)
 		buf_cache_insert_hash(sb, &(p_fs->buf_cache_array[i]));
 
 	return FFS_SUCCESS;
@@ -124,6 +172,25 @@ s32 buf_init(struct super_block *sb)
 
 s32 buf_shutdown(struct super_block *sb)
 {
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if (p_fs->FAT_cache_array && p_fs->buf_cache_array) {
+		FAT_release_all(sb);
+		buf_release_all(sb);
+	}
+
+	if (p_fs->FAT_cache_array) {
+		vfree(p_fs->FAT_cache_array);
+		p_fs->FAT_cache_array = NULL;
+		p_fs->FAT_cache_hash_list = NULL;
+	}
+
+	if (p_fs->buf_cache_array) {
+		vfree(p_fs->buf_cache_array);
+		p_fs->buf_cache_array = NULL;
+		p_fs->buf_cache_hash_list = NULL;
+	}
+
 	return FFS_SUCCESS;
 } /* end of buf_shutdown */
 
@@ -139,12 +206,13 @@ s32 buf_shutdown(struct super_block *sb)
 s32 FAT_read(struct super_block *sb, u32 loc, u32 *content)
 {
 	s32 ret;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	ret = __FAT_read(sb, loc, content);
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 
 	return ret;
 } /* end of FAT_read */
@@ -152,12 +220,13 @@ s32 FAT_read(struct super_block *sb, u32 loc, u32 *content)
 s32 FAT_write(struct super_block *sb, u32 loc, u32 content)
 {
 	s32 ret;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	ret = __FAT_write(sb, loc, content);
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 
 	return ret;
 } /* end of FAT_write */
@@ -381,6 +450,36 @@ static s32 __FAT_write(struct super_block *sb, u32 loc, u32 content)
 	return 0;
 } /* end of __FAT_write */
 
+/*
+ * Start reading the FAT sectors from 'sec' on, so that a chain walk or a
+ * free cluster search that keeps missing the FAT cache finds them in the
+ * page cache of the block device instead of waiting for each one.
+ */
+static void FAT_readahead(struct super_block *sb, u32 sec)
+{
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+	struct blk_plug plug;
+	u32 end;
+
+	/* already read ahead */
+	if ((sec >= p_fs->FAT_ra_start) && (sec < p_fs->FAT_ra_end))
+		return;
+
+	end = p_fs->FAT1_start_sector + p_fs->num_FAT_sectors;
+	if ((sec < p_fs->FAT1_start_sector) || (sec >= end))
+		return;
+	end = min_t(u32, end, sec + FAT_RA_SIZE);
+
+	p_fs->FAT_ra_start = sec;
+	p_fs->FAT_ra_end = end;
+
+	blk_start_plug(&plug);
+	for (; sec < end; sec++)
+		__breadahead(sb->s_bdev, sec, p_bd->sector_size);
+	blk_finish_plug(&plug);
+} /* end of FAT_readahead */
+
 u8 *FAT_getblk(struct super_block *sb, u32 sec)
 {
 	BUF_CACHE_T *bp;
@@ -392,6 +491,8 @@ u8 *FAT_getblk(struct super_block *sb, u32 sec)
 		return bp->buf_bh->b_data;
 	}
 
+	FAT_readahead(sb, sec);
+
 	bp = FAT_cache_get(sb, sec);
 
 	FAT_cache_remove_hash(bp);
@@ -430,7 +531,7 @@ void FAT_release_all(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	bp = p_fs->FAT_cache_lru_list.next;
 	while (bp != &p_fs->FAT_cache_lru_list) {
@@ -447,7 +548,7 @@ void FAT_release_all(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 } /* end of FAT_release_all */
 
 void FAT_sync(struct super_block *sb)
@@ -455,7 +556,7 @@ void FAT_sync(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->FAT_cache_sem);
 
 	bp = p_fs->FAT_cache_lru_list.next;
 	while (bp != &p_fs->FAT_cache_lru_list) {
@@ -466,7 +567,7 @@ void FAT_sync(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->FAT_cache_sem);
 } /* end of FAT_sync */
 
 static BUF_CACHE_T *FAT_cache_find(struct super_block *sb, u32 sec)
@@ -475,7 +576,7 @@ static BUF_CACHE_T *FAT_cache_find(struct super_block *sb, u32 sec)
 	BUF_CACHE_T *bp, *hp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & (FAT_CACHE_HASH_SIZE - 1);
+	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & p_fs->FAT_cache_hash_mask;
 
 	hp = &(p_fs->FAT_cache_hash_list[off]);
 	for (bp = hp->hash_next; bp != hp; bp = bp->hash_next) {
@@ -510,7 +611,7 @@ static void FAT_cache_insert_hash(struct super_block *sb, BUF_CACHE_T *bp)
 	FS_INFO_T *p_fs;
 
 	p_fs = &(EXFAT_SB(sb)->fs_info);
-	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & (FAT_CACHE_HASH_SIZE-1);
+	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & p_fs->FAT_cache_hash_mask;
 
 	hp = &(p_fs->FAT_cache_hash_list[off]);
 	bp->hash_next = hp->hash_next;
@@ -532,12 +633,13 @@ static void FAT_cache_remove_hash(BUF_CACHE_T *bp)
 u8 *buf_getblk(struct super_block *sb, u32 sec)
 {
 	u8 *buf;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
+	sm_P(&p_fs->buf_cache_sem);
 
 	buf = __buf_getblk(sb, sec);
 
-	sm_V(&b_sem);
+	sm_V(&p_fs->buf_cache_sem);
 
 	return buf;
 } /* end of buf_getblk */
@@ -581,8 +683,9 @@ static u8 *__buf_getblk(struct super_block *sb, u32 sec)
 void buf_modify(struct super_block *sb, u32 sec)
 {
 	BUF_CACHE_T *bp;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
+	sm_P(&p_fs->buf_cache_sem);
 
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL))
@@ -590,14 +693,15 @@ void buf_modify(struct super_block *sb, u32 sec)
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
 
-	sm_V(&b_sem);
+	sm_V(&p_fs->buf_cache_sem);
 } /* end of buf_modify */
 
 void buf_lock(struct super_block *sb, u32 sec)
 {
 	BUF_CACHE_T *bp;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
+	sm_P(&p_fs->buf_cache_sem);
 
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL))
@@ -605,14 +709,15 @@ void buf_lock(struct super_block *sb, u32 sec)
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
 
-	sm_V(&b_sem);
+	sm_V(&p_fs->buf_cache_sem);
 } /* end of buf_lock */
 
 void buf_unlock(struct super_block *sb, u32 sec)
 {
 	BUF_CACHE_T *bp;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
+	sm_P(&p_fs->buf_cache_sem);
 
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL))
@@ -620,7 +725,7 @@ void buf_unlock(struct super_block *sb, u32 sec)
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
 
-	sm_V(&b_sem);
+	sm_V(&p_fs->buf_cache_sem);
 } /* end of buf_unlock */
 
 void buf_release(struct super_block *sb, u32 sec)
@@ -628,7 +733,7 @@ void buf_release(struct super_block *sb, u32 sec)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
+	sm_P(&p_fs->buf_cache_sem);
 
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL)) {
@@ -644,7 +749,7 @@ void buf_release(struct super_block *sb, u32 sec)
 		move_to_lru(bp, &p_fs->buf_cache_lru_list);
 	}
 
-	sm_V(&b_sem);
+	sm_V(&p_fs->buf_cache_sem);
 } /* end of buf_release */
 
 void buf_release_all(struct super_block *sb)
@@ -652,7 +757,7 @@ void buf_release_all(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
+	sm_P(&p_fs->buf_cache_sem);
 
 	bp = p_fs->buf_cache_lru_list.next;
 	while (bp != &p_fs->buf_cache_lru_list) {
@@ -669,7 +774,7 @@ void buf_release_all(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&b_sem);
+	sm_V(&p_fs->buf_cache_sem);
 } /* end of buf_release_all */
 
 void buf_sync(struct super_block *sb)
@@ -677,7 +782,7 @@ void buf_sync(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
+	sm_P(&p_fs->buf_cache_sem);
 
 	bp = p_fs->buf_cache_lru_list.next;
 	while (bp != &p_fs->buf_cache_lru_list) {
@@ -688,7 +793,7 @@ void buf_sync(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&b_sem);
+	sm_V(&p_fs->buf_cache_sem);
 } /* end of buf_sync */
 
 static BUF_CACHE_T *buf_cache_find(struct super_block *sb, u32 sec)
@@ -697,7 +802,7 @@ static BUF_CACHE_T *buf_cache_find(struct super_block *sb, u32 sec)
 	BUF_CACHE_T *bp, *hp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & (BUF_CACHE_HASH_SIZE - 1);
+	off = (sec + (sec >> p_fs->sectors_per_clu_bits)) & p_fs->buf_cache_hash_mask;
 
 	hp = &(p_fs->buf_cache_hash_list[off]);
 	for (bp = hp->hash_next; bp != hp; bp = bp->hash_next) {
@@ -730,7 +835,7 @@ static void buf_cache_insert_hash(struct super_block *sb, BUF_CACHE_T *bp)
 	FS_INFO_T *p_fs;
 
 	p_fs = &(EXFAT_SB(sb)->fs_info);
-	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & (BUF_CACHE_HASH_SIZE-1);
+	off = (bp->sec + (bp->sec >> p_fs->sectors_per_clu_bits)) & p_fs->buf_cache_hash_mask;
 
 	hp = &(p_fs->buf_cache_hash_list[off]);
 	bp->hash_next = hp->hash_next;
@@ -745,6 +850,293 @@ static void buf_cache_remove_hash(BUF_CACHE_T *bp)
 	(bp->hash_next)->hash_prev = bp->hash_prev;
 } /* end of buf_cache_remove_hash */
 
+/*======================================================================*/
+/*  Extent Cache Functions                                              */
+/*======================================================================*/
+
+/*
+ * Each inode keeps a small LRU of the cluster runs found while walking its
+ * FAT chain, so that mapping a file offset does not have to follow the
+ * chain from the start cluster (or the last hint) on every call, and so
+ * that contiguous runs can be mapped in one go.
+ *
+ * The caches are protected by cache_lru_lock of the inode. A walk of the
+ * FAT chain is done without it, so a cache found before the walk is only
+ * added back if the inode's caches were not invalidated meanwhile
+ * (cache_valid_id).
+ */
+
+#define EXTENT_MAX_CACHE        8
+#define EXTENT_CACHE_VALID      0
+
+typedef struct {
+	s32 fcluster;
+	u32 dcluster;
+	u32 nr_contig;
+	unsigned int id;
+} EXTENT_CACHE_ID_T;
+
+static struct kmem_cache *extent_cachep;
+
+static void extent_cache_init_once(void *c)
+{
+	EXTENT_CACHE_T *cache = (EXTENT_CACHE_T *)c;
+
+	INIT_LIST_HEAD(&cache->cache_list);
+}
+
+s32 extent_cache_init(void)
+{
+	extent_cachep = kmem_cache_create("exfat_extent_cache",
+					  sizeof(EXTENT_CACHE_T),
+					  0, SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD,
+					  extent_cache_init_once);
+	if (extent_cachep == NULL)
+		return FFS_MEMORYERR;
+	return FFS_SUCCESS;
+} /* end of extent_cache_init */
+
+void extent_cache_shutdown(void)
+{
+	if (extent_cachep == NULL)
+		return;
+	kmem_cache_destroy(extent_cachep);
+	extent_cachep = NULL;
+} /* end of extent_cache_shutdown */
+
+void extent_cache_init_inode(struct inode *inode)
+{
+	struct exfat_inode_info *ei = EXFAT_I(inode);
+
+	spin_lock_init(&ei->cache_lru_lock);
+	ei->nr_caches = 0;
+	ei->cache_valid_id = EXTENT_CACHE_VALID + 1;
+	INIT_LIST_HEAD(&ei->cache_lru);
+} /* end of extent_cache_init_inode */
+
+static inline void extent_cache_update_lru(struct inode *inode,
+					   EXTENT_CACHE_T *cache)
+{
+	struct exfat_inode_info *ei = EXFAT_I(inode);
+
+	if (ei->cache_lru.next != &cache->cache_list)
+		list_move(&cache->cache_list, &ei->cache_lru);
+}
+
+/*
+ * Find the cached run closest below 'fclus'. Returns the offset into it
+ * at which the walk towards 'fclus' can start (its last cluster if 'fclus'
+ * lies beyond it), or -1 if nothing is cached below 'fclus'.
+ */
+static s32 extent_cache_lookup(struct inode *inode, s32 fclus,
+			       EXTENT_CACHE_ID_T *cid,
+			       s32 *cached_fclus, u32 *cached_dclus)
+{
+	struct exfat_inode_info *ei = EXFAT_I(inode);
+	EXTENT_CACHE_T *hit = NULL, *p;
+	s32 offset = -1;
+
+	spin_lock(&ei->cache_lru_lock);
+	list_for_each_entry(p, &ei->cache_lru, cache_list) {
+		/* Find the cache of "fclus" or nearest cache. */
+		if (p->fcluster <= fclus &&
+		    (hit == NULL || hit->fcluster < p->fcluster)) {
+			hit = p;
+			if ((hit->fcluster + (s32)hit->nr_contig) < fclus) {
+				offset = hit->nr_contig;
+			} else {
+				offset = fclus - hit->fcluster;
+				break;
+			}
+		}
+	}
+	if (hit != NULL) {
+		extent_cache_update_lru(inode, hit);
+
+		cid->id = ei->cache_valid_id;
+		cid->nr_contig = hit->nr_contig;
+		cid->fcluster = hit->fcluster;
+		cid->dcluster = hit->dcluster;
+		*cached_fclus = cid->fcluster + offset;
+		*cached_dclus = cid->dcluster + offset;
+	}
+	spin_unlock(&ei->cache_lru_lock);
+
+	return offset;
+} /* end of extent_cache_lookup */
+
+static EXTENT_CACHE_T *extent_cache_merge(struct inode *inode,
+					  EXTENT_CACHE_ID_T *new)
+{
+	EXTENT_CACHE_T *p;
+
+	list_for_each_entry(p, &EXFAT_I(inode)->cache_lru, cache_list) {
+		/* Find the same part as "new" in cluster-chain. */
+		if (p->fcluster == new->fcluster) {
+			if (new->nr_contig > p->nr_contig)
+				p->nr_contig = new->nr_contig;
+			return p;
+		}
+	}
+	return NULL;
+} /* end of extent_cache_merge */
+
+static void extent_cache_add(struct inode *inode, EXTENT_CACHE_ID_T *new)
+{
+	struct exfat_inode_info *ei = EXFAT_I(inode);
+	EXTENT_CACHE_T *cache, *tmp;
+
+	spin_lock(&ei->cache_lru_lock);
+	if (new->id != EXTENT_CACHE_VALID &&
+	    new->id != ei->cache_valid_id)
+		goto out;	/* this cache was invalidated */
+
+	cache = extent_cache_merge(inode, new);
+	if (cache == NULL) {
+		if (ei->nr_caches < EXTENT_MAX_CACHE) {
+			ei->nr_caches++;
+			spin_unlock(&ei->cache_lru_lock);
+
+			tmp = kmem_cache_alloc(extent_cachep, GFP_NOFS);
+			if (!tmp) {
+				spin_lock(&ei->cache_lru_lock);
+				ei->nr_caches--;
+				spin_unlock(&ei->cache_lru_lock);
+				return;
+			}
+
+			spin_lock(&ei->cache_lru_lock);
+			cache = extent_cache_merge(inode, new);
+			if (cache != NULL) {
+				ei->nr_caches--;
+				kmem_cache_free(extent_cachep, tmp);
+				goto out_update_lru;
+			}
+			cache = tmp;
+		} else {
+			/* reuse the least recently used one */
+			cache = list_entry(ei->cache_lru.prev,
+					   EXTENT_CACHE_T, cache_list);
+		}
+		cache->fcluster = new->fcluster;
+		cache->dcluster = new->dcluster;
+		cache->nr_contig = new->nr_contig;
+	}
+out_update_lru:
+	extent_cache_update_lru(inode, cache);
+out:
+	spin_unlock(&ei->cache_lru_lock);
+} /* end of extent_cache_add */
+
+/*
+ * Drop all caches of the inode. Must be called whenever clusters of the
+ * inode are freed or its chain is otherwise rewritten.
+ */
+void extent_cache_inval_inode(struct inode *inode)
+{
+	struct exfat_inode_info *ei = EXFAT_I(inode);
+	EXTENT_CACHE_T *cache;
+
+	spin_lock(&ei->cache_lru_lock);
+	while (!list_empty(&ei->cache_lru)) {
+		cache = list_entry(ei->cache_lru.next,
+				   EXTENT_CACHE_T, cache_list);
+		list_del_init(&cache->cache_list);
+		ei->nr_caches--;
+		kmem_cache_free(extent_cachep, cache);
+	}
+	/* Update. The copy of caches before this id is discarded. */
+	ei->cache_valid_id++;
+	if (ei->cache_valid_id == EXTENT_CACHE_VALID)
+		ei->cache_valid_id++;
+	spin_unlock(&ei->cache_lru_lock);
+} /* end of extent_cache_inval_inode */
+
+static inline s32 extent_cache_contiguous(EXTENT_CACHE_ID_T *cid, u32 dclus)
+{
+	cid->nr_contig++;
+	return ((cid->dcluster + cid->nr_contig) == dclus);
+}
+
+static inline void extent_cache_init_id(EXTENT_CACHE_ID_T *cid,
+					s32 fclus, u32 dclus)
+{
+	cid->id = EXTENT_CACHE_VALID;
+	cid->fcluster = fclus;
+	cid->dcluster = dclus;
+	cid->nr_contig = 0;
+}
+
+/*
+ * extent_get_clus : map file cluster 'cluster' of a FAT-chained file
+ *
+ * On success *dclus is the disk cluster of 'cluster' and *count the
+ * number of clusters (at most 'max_count', at least 1) that are
+ * contiguous on disk from there. If the chain ends before 'cluster',
+ * *dclus is CLUSTER_32(~0) and *last_dclus the last cluster of the chain.
+ * The run that was walked through is cached for the next lookups.
+ *
+ * Returns -1 on a FAT read error.
+ */
+s32 extent_get_clus(struct inode *inode, s32 cluster, u32 max_count,
+		       u32 *dclus, u32 *count, u32 *last_dclus)
+{
+	struct super_block *sb = inode->i_sb;
+	FILE_ID_T *fid = &(EXFAT_I(inode)->fid);
+	EXTENT_CACHE_ID_T cid;
+	s32 fclus;
+	u32 clu, next;
+
+	fclus = 0;
+	clu = fid->start_clu;
+	*last_dclus = CLUSTER_32(~0);
+	*count = 0;
+
+	if (clu == CLUSTER_32(~0)) {
+		*dclus = clu;
+		return 0;
+	}
+
+	if (extent_cache_lookup(inode, cluster, &cid, &fclus, &clu) < 0) {
+		/* nothing cached, start from the head of the chain */
+		extent_cache_init_id(&cid, 0, clu);
+	}
+
+	while (fclus < cluster) {
+		if (FAT_read(sb, clu, &next) == -1)
+			return -1;
+
+		if (next == CLUSTER_32(~0)) {
+			/* the chain is shorter than the request */
+			extent_cache_add(inode, &cid);
+			*last_dclus = clu;
+			*dclus = next;
+			return 0;
+		}
+
+		fclus++;
+		if (!extent_cache_contiguous(&cid, next))
+			extent_cache_init_id(&cid, fclus, next);
+		clu = next;
+	}
+
+	/* the rest of the cached run, then what follows it in the FAT */
+	*dclus = clu;
+	*count = min_t(u32, max_count,
+		       cid.fcluster + cid.nr_contig - fclus + 1);
+	while (*count < max_count) {
+		if (FAT_read(sb, clu + *count - 1, &next) == -1)
+			return -1;
+		if (next != clu + *count)
+			break;
+		cid.nr_contig++;
+		(*count)++;
+	}
+
+	extent_cache_add(inode, &cid);
+	return 0;
+} /* end of extent_get_clus */
+
 /*======================================================================*/
 /*  Local Function Definitions                                          */
 /*======================================================================*/
@@ -62,6 +62,14 @@ typedef struct __BUF_CACHE_T {
 	struct buffer_head   *buf_bh;
 } BUF_CACHE_T;
 
+/* a run of contiguous clusters of a file, cached in its inode */
+typedef struct __EXTENT_CACHE_T {
+	struct list_head  cache_list;
+	s32               fcluster;  /* first cluster of the run in the file */
+	u32               dcluster;  /* first cluster of the run on disk */
+	u32               nr_contig; /* number of clusters following them */
+} EXTENT_CACHE_T;
+
 /*----------------------------------------------------------------------*/
 /*  External Function Declarations                                      */
 /*----------------------------------------------------------------------*/
@@ -82,4 +90,11 @@ void   buf_release(struct super_block *sb, u32 sec);
 void   buf_release_all(struct super_block *sb);
 void   buf_sync(struct super_block *sb);
 
+s32  extent_cache_init(void);
+void   extent_cache_shutdown(void);
+void   extent_cache_init_inode(struct inode *inode);
+void   extent_cache_inval_inode(struct inode *inode);
+s32  extent_get_clus(struct inode *inode, s32 cluster, u32 max_count,
+		       u32 *dclus, u32 *count, u32 *last_dclus);
+
 #endif /* _EXFAT_CACHE_H */
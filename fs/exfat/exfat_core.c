@@ -44,6 +44,7 @@
 #include <linux/version.h>
 #include <linux/param.h>
 #include <linux/log2.h>
+#include <linux/vmalloc.h>
 
 #include "exfat_bitmap.h"
 #include "exfat_config.h"
@@ -138,6 +139,10 @@ s32 ffsInit(void)
 	if (ret)
 		return ret;
 
+	ret = extent_cache_init();
+	if (ret)
+		return ret;
+
 	return FFS_SUCCESS;
 } /* end of ffsInit */
 
@@ -145,6 +150,9 @@ s32 ffsInit(void)
 s32 ffsShutdown(void)
 {
 	s32 ret;
+
+	extent_cache_shutdown();
+
 	ret = fs_shutdown();
 	if (ret)
 		return ret;
@@ -167,8 +175,11 @@ s32 ffsMountVol(struct super_block *sb)
 
 	printk("[EXFAT] trying to mount...\n");
 
-	sm_init(&p_fs->v_sem);
+	rwsm_init(&p_fs->v_sem);
 	p_fs->dev_ejected = FALSE;
+	p_fs->amap_sum = NULL;
+	spin_lock_init(&p_fs->prealloc_lock);
+	INIT_LIST_HEAD(&p_fs->prealloc_list);
 
 	/* open the block device */
 	if (bdev_open(sb))
@@ -215,15 +226,25 @@ s32 ffsMountVol(struct super_block *sb)
 		return ret;
 	}
 
+	/* the caches are sized after the volume geometry */
+	ret = buf_init(sb);
+	if (ret) {
+		buf_shutdown(sb);
+		bdev_close(sb);
+		return ret;
+	}
+
 	if (p_fs->vol_type == EXFAT) {
 		ret = load_alloc_bitmap(sb);
 		if (ret) {
+			buf_shutdown(sb);
 			bdev_close(sb);
 			return ret;
 		}
 		ret = load_upcase_table(sb);
 		if (ret) {
 			free_alloc_bitmap(sb);
+			buf_shutdown(sb);
 			bdev_close(sb);
 			return ret;
 		}
@@ -234,6 +255,7 @@ s32 ffsMountVol(struct super_block *sb)
 			free_upcase_table(sb);
 			free_alloc_bitmap(sb);
 		}
+		buf_shutdown(sb);
 		bdev_close(sb);
 		return FFS_MEDIAERR;
 	}
@@ -824,6 +846,8 @@ s32 ffsTruncateFile(struct inode *inode, u64 old_size, u64 new_size)
 
 	/* hint information */
 	fid->hint_last_off = -1;
+	extent_cache_inval_inode(inode);
+	exfat_prealloc_discard(inode);
 	if (fid->rwoffset > fid->size)
 		fid->rwoffset = fid->size;
 
@@ -1282,10 +1306,19 @@ s32 ffsSetStat(struct inode *inode, DIR_ENTRY_T *info)
 	return FFS_SUCCESS;
 } /* end of ffsSetStat */
 
-s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
+/*
+ * ffsMapCluster : map cluster 'clu_offset' of the file to *clu, allocating
+ * it if it lies just past the end of the file. On input *clu_count is the
+ * number of clusters the caller would like mapped; on return it is the
+ * number of clusters, starting at *clu, that are contiguous on disk.
+ * Without 'alloc' nothing is written and *clu is left at CLUSTER_32(~0)
+ * for a cluster that still has to be allocated; the caller may then hold
+ * v_sem only for reading.
+ */
+s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu, u32 *clu_count, s32 alloc)
 {
 	s32 num_clusters, num_alloced, modified = FALSE;
-	u32 last_clu, sector = 0;
+	u32 last_clu, sector = 0, max_count = *clu_count;
 	CHAIN_T new_clu;
 	DENTRY_T *ep;
 	ENTRY_SET_CACHE_T *es = NULL;
@@ -1293,14 +1326,13 @@ s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 	FILE_ID_T *fid = &(EXFAT_I(inode)->fid);
 
-	fid->rwoffset = (s64)(clu_offset) << p_fs->cluster_size_bits;
-
 	if (EXFAT_I(inode)->mmu_private == 0)
 		num_clusters = 0;
 	else
 		num_clusters = (s32)((EXFAT_I(inode)->mmu_private-1) >> p_fs->cluster_size_bits) + 1;
 
 	*clu = last_clu = fid->start_clu;
+	*clu_count = 1;
 
 	if (fid->flags == 0x03) {
 		if ((clu_offset > 0) && (*clu != CLUSTER_32(~0))) {
@@ -1311,29 +1343,33 @@ s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
 			else
 				*clu += clu_offset;
 		}
-	} else {
-		/* hint information */
-		if ((clu_offset > 0) && (fid->hint_last_off > 0) &&
-			(clu_offset >= fid->hint_last_off)) {
-			clu_offset -= fid->hint_last_off;
-			*clu = fid->hint_last_clu;
-		}
 
-		while ((clu_offset > 0) && (*clu != CLUSTER_32(~0))) {
-			last_clu = *clu;
-			if (FAT_read(sb, *clu, clu) == -1)
-				return FFS_MEDIAERR;
-			clu_offset--;
-		}
+		/* the whole file is contiguous, no need to look at the FAT */
+		if ((*clu != CLUSTER_32(~0)) && (clu_offset < num_clusters))
+			*clu_count = min_t(u32, max_count, num_clusters - clu_offset);
+	} else if (*clu != CLUSTER_32(~0)) {
+		if (extent_get_clus(inode, clu_offset, max_count,
+				    clu, clu_count, &last_clu) == -1)
+			return FFS_MEDIAERR;
+		if (*clu == CLUSTER_32(~0))
+			*clu_count = 1;
 	}
 
-	if (*clu == CLUSTER_32(~0)) {
+	if ((*clu == CLUSTER_32(~0)) && alloc) {
 		fs_set_vol_flags(sb, VOL_DIRTY);
 
 		new_clu.dir = (last_clu == CLUSTER_32(~0)) ? CLUSTER_32(~0) : last_clu+1;
 		new_clu.size = 0;
 		new_clu.flags = fid->flags;
 
+		if (p_fs->vol_type == EXFAT) {
+			new_clu.dir = exfat_prealloc_hint(inode, last_clu, num_clusters);
+
+			/* continuing anywhere but right after the end needs a FAT chain */
+			if ((last_clu != CLUSTER_32(~0)) && (new_clu.dir != last_clu+1))
+				new_clu.flags = 0x01;
+		}
+
 		/* (1) allocate a cluster */
 		num_alloced = p_fs->fs_func->alloc_cluster(sb, 1, &new_clu);
 		if (num_alloced < 0)
@@ -1393,11 +1429,11 @@ s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
 
 		/* add number of new blocks to inode */
 		inode->i_blocks += num_alloced << (p_fs->cluster_size_bits - 9);
-	}
 
-	/* hint information */
-	fid->hint_last_off = (s32)(fid->rwoffset >> p_fs->cluster_size_bits);
-	fid->hint_last_clu = *clu;
+		/* hint information */
+		fid->hint_last_off = clu_offset;
+		fid->hint_last_clu = *clu;
+	}
 
 	if (p_fs->dev_ejected)
 		return FFS_MEDIAERR;
@@ -1847,12 +1883,15 @@ s32 fat_alloc_cluster(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain)
 s32 exfat_alloc_cluster(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain)
 {
 	s32 num_clusters = 0;
-	u32 hint_clu, new_clu, last_clu = CLUSTER_32(~0);
+	u32 hint_clu, new_clu, last_clu = CLUSTER_32(~0), len;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	hint_clu = p_chain->dir;
 	if (hint_clu == CLUSTER_32(~0)) {
-		hint_clu = test_alloc_bitmap(sb, p_fs->clu_srch_ptr-2);
+		/* stay out of the windows set aside for appending files */
+		hint_clu = find_free_run(sb, p_fs->clu_srch_ptr, 1, NULL, &len);
+		if (hint_clu == CLUSTER_32(~0))
+			hint_clu = test_alloc_bitmap(sb, p_fs->clu_srch_ptr-2);
 		if (hint_clu == CLUSTER_32(~0))
 			return 0;
 	} else if (hint_clu >= p_fs->num_clusters) {
@@ -2088,6 +2127,12 @@ s32 exfat_count_used_clusters(struct super_block *sb)
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
 
+	if (p_fs->amap_sum) {
+		for (i = 0; i < p_fs->map_sectors; i++)
+			count += p_fs->amap_sum[i].free;
+		return p_fs->num_clusters - 2 - count;
+	}
+
 	map_i = map_b = 0;
 
 	for (i = 2; i < p_fs->num_clusters; i += 8) {
@@ -2121,6 +2166,73 @@ void exfat_chain_cont_cluster(struct super_block *sb, u32 chain, s32 len)
  *  Allocation Bitmap Management Functions
  */
 
+/* number of clusters covered by allocation bitmap sector 'i' */
+static u32 amap_sector_bits(struct super_block *sb, s32 i)
+{
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+	u32 first = (u32) i << (p_bd->sector_size_bits + 3);
+
+	if (first >= p_fs->num_clusters - 2)
+		return 0;
+	return min_t(u32, p_bd->sector_size << 3, p_fs->num_clusters - 2 - first);
+} /* end of amap_sector_bits */
+
+/* recompute the free space summary of allocation bitmap sector 'i' */
+static void amap_sum_scan(struct super_block *sb, s32 i)
+{
+	u8 *map, k;
+	u32 b, n, nbits, run = 0, head = ~0, max_run = 0, num_free = 0;
+	s32 used;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	AMAP_SUM_T *sum = &(p_fs->amap_sum[i]);
+
+	map = (u8 *) p_fs->vol_amap[i]->b_data;
+	nbits = amap_sector_bits(sb, i);
+
+	for (b = 0; b < nbits; b += n) {
+		k = map[b >> 3];
+		if (!(b & 7) && ((b + 8) <= nbits) && ((k == 0x00) || (k == 0xFF))) {
+			n = 8;
+			used = (k == 0xFF);
+		} else {
+			n = 1;
+			used = exfat_bitmap_test(map, b);
+		}
+
+		if (used) {
+			if (head == (u32) ~0)
+				head = run;
+			if (run > max_run)
+				max_run = run;
+			run = 0;
+		} else {
+			run += n;
+			num_free += n;
+		}
+	}
+
+	if (head == (u32) ~0)
+		head = run;
+	if (run > max_run)
+		max_run = run;
+
+	sum->free = num_free;
+	sum->max_run = max_run;
+	sum->head = head;
+	sum->tail = run;
+} /* end of amap_sum_scan */
+
+/* is bit 'clu' of the allocation bitmap set */
+static s32 amap_test(struct super_block *sb, u32 clu)
+{
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	return exfat_bitmap_test((u8 *) p_fs->vol_amap[clu >> (p_bd->sector_size_bits + 3)]->b_data,
+				 clu & ((p_bd->sector_size << 3) - 1));
+} /* end of amap_test */
+
 s32 load_alloc_bitmap(struct super_block *sb)
 {
 	int i, j, ret;
@@ -2178,6 +2290,13 @@ s32 load_alloc_bitmap(struct super_block *sb)
 					}
 				}
 
+				/* without the summary we just search the bitmap linearly */
+				p_fs->amap_sum = vmalloc(sizeof(AMAP_SUM_T) * p_fs->map_sectors);
+				if (p_fs->amap_sum) {
+					for (j = 0; j < p_fs->map_sectors; j++)
+						amap_sum_scan(sb, j);
+				}
+
 				p_fs->pbr_bh = NULL;
 				return FFS_SUCCESS;
 			}
@@ -2203,6 +2322,10 @@ void free_alloc_bitmap(struct super_block *sb)
 	if (p_fs->vol_amap)
 		kfree(p_fs->vol_amap);
 	p_fs->vol_amap = NULL;
+
+	if (p_fs->amap_sum)
+		vfree(p_fs->amap_sum);
+	p_fs->amap_sum = NULL;
 } /* end of free_alloc_bitmap */
 
 s32 set_alloc_bitmap(struct super_block *sb, u32 clu)
@@ -2217,6 +2340,11 @@ s32 set_alloc_bitmap(struct super_block *sb, u32 clu)
 
 	sector = START_SECTOR(p_fs->map_clu) + i;
 
+	if (p_fs->amap_sum && !exfat_bitmap_test((u8 *) p_fs->vol_amap[i]->b_data, b)) {
+		p_fs->amap_sum[i].free--;
+		p_fs->amap_sum[i].max_run = AMAP_RUN_UNKNOWN;
+	}
+
 	exfat_bitmap_set((u8 *) p_fs->vol_amap[i]->b_data, b);
 
 	return sector_write(sb, sector, p_fs->vol_amap[i], 0);
@@ -2239,6 +2367,11 @@ s32 clr_alloc_bitmap(struct super_block *sb, u32 clu)
 
 	sector = START_SECTOR(p_fs->map_clu) + i;
 
+	if (p_fs->amap_sum && exfat_bitmap_test((u8 *) p_fs->vol_amap[i]->b_data, b)) {
+		p_fs->amap_sum[i].free++;
+		p_fs->amap_sum[i].max_run = AMAP_RUN_UNKNOWN;
+	}
+
 	exfat_bitmap_clear((u8 *) p_fs->vol_amap[i]->b_data, b);
 
 	return sector_write(sb, sector, p_fs->vol_amap[i], 0);
@@ -2273,6 +2406,18 @@ u32 test_alloc_bitmap(struct super_block *sb, u32 clu)
 	map_b = (clu >> 3) & p_bd->sector_size_mask;
 
 	for (i = 2; i < p_fs->num_clusters; i += 8) {
+		if ((map_b == 0) && p_fs->amap_sum && (p_fs->amap_sum[map_i].free == 0)) {
+			/* nothing free in this bitmap sector */
+			i += (p_bd->sector_size << 3) - 8;
+			clu_base += p_bd->sector_size << 3;
+			clu_mask = 0;
+			if (((++map_i) >= p_fs->map_sectors) || (clu_base >= p_fs->num_clusters)) {
+				clu_base = 2;
+				map_i = 0;
+			}
+			continue;
+		}
+
 		k = *(((u8 *) p_fs->vol_amap[map_i]->b_data) + map_b);
 		if (clu_mask > 0) {
 			k |= clu_mask;
@@ -2297,6 +2442,254 @@ u32 test_alloc_bitmap(struct super_block *sb, u32 clu)
 	return CLUSTER_32(~0);
 } /* end of test_alloc_bitmap */
 
+/*
+ * Search bits [from, to) of the allocation bitmap for the first free run
+ * of at least 'want' clusters, and return its first bit. Bitmap sectors
+ * whose summary shows no such run are stepped over whole; the longest
+ * run seen on the way is kept in *best and *best_len.
+ */
+static u32 amap_scan(struct super_block *sb, u32 from, u32 to, u32 want,
+		     u32 *best, u32 *best_len)
+{
+	u8 *map, k;
+	u32 b, n, off, run = 0, start = 0;
+	u32 bps_bits;
+	s32 i, used;
+	AMAP_SUM_T *sum;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	bps_bits = p_bd->sector_size << 3;
+
+	for (b = from; b < to; b += n) {
+		i = b >> (p_bd->sector_size_bits + 3);
+		off = b & (bps_bits - 1);
+
+		if (!off && ((b + bps_bits) <= to)) {
+			sum = &(p_fs->amap_sum[i]);
+			if (sum->max_run == AMAP_RUN_UNKNOWN)
+				amap_sum_scan(sb, i);
+
+			if ((sum->free == 0) || (sum->free == bps_bits)) {
+				n = bps_bits;
+				used = (sum->free == 0);
+				goto account;
+			}
+
+			if (((run + sum->head) < want) && (sum->max_run < want) &&
+			    (sum->max_run <= *best_len)) {
+				/* nothing to find inside, go on with its tail */
+				if ((run + sum->head) > *best_len) {
+					*best = run ? start : b;
+					*best_len = run + sum->head;
+				}
+				run = sum->tail;
+				start = b + bps_bits - run;
+				n = bps_bits;
+				continue;
+			}
+		}
+
+		map = (u8 *) p_fs->vol_amap[i]->b_data;
+		k = map[off >> 3];
+		if (!(off & 7) && ((b + 8) <= to) && ((k == 0x00) || (k == 0xFF))) {
+			n = 8;
+			used = (k == 0xFF);
+		} else {
+			n = 1;
+			used = exfat_bitmap_test(map, off);
+		}
+
+account:
+		if (used) {
+			if (run > *best_len) {
+				*best = start;
+				*best_len = run;
+			}
+			run = 0;
+		} else {
+			if (!run)
+				start = b;
+			run += n;
+			if (run >= want)
+				return start;
+		}
+	}
+
+	if (run > *best_len) {
+		*best = start;
+		*best_len = run;
+	}
+
+	return CLUSTER_32(~0);
+} /* end of amap_scan */
+
+/*
+ * Find the preallocation window, other than the one of 'self', that
+ * overlaps clusters [clu, clu + len) and starts first. Returns the
+ * cluster following it and its start in *w_start, or 0 if there is none.
+ */
+static u32 prealloc_overlap(FS_INFO_T *p_fs, struct exfat_inode_info *self,
+			    u32 clu, u32 len, u32 *w_start)
+{
+	struct exfat_inode_info *ei;
+	u32 start = 0, end = 0;
+
+	spin_lock(&p_fs->prealloc_lock);
+	list_for_each_entry(ei, &p_fs->prealloc_list, prealloc_list) {
+		if (ei == self)
+			continue;
+		if ((ei->prealloc_start >= clu + len) ||
+		    (ei->prealloc_start + ei->prealloc_len <= clu))
+			continue;
+		if (!end || (ei->prealloc_start < start)) {
+			start = ei->prealloc_start;
+			end = ei->prealloc_start + ei->prealloc_len;
+		}
+	}
+	spin_unlock(&p_fs->prealloc_lock);
+
+	if (w_start)
+		*w_start = start;
+	return end;
+} /* end of prealloc_overlap */
+
+/*
+ * find_free_run : find 'want' free clusters in a row at or after 'clu',
+ * wrapping around at the end of the volume, that are not set aside for
+ * another file than 'inode'. If there is no such run the longest free
+ * run is returned instead. *len is set to the number of clusters found;
+ * returns CLUSTER_32(~0) if nothing suitable is free or the volume has
+ * no bitmap summary.
+ */
+u32 find_free_run(struct super_block *sb, u32 clu, u32 want, struct inode *inode, u32 *len)
+{
+	u32 from, b, to, start, end, best = 0, best_len = 0;
+	s32 wrapped = FALSE;
+	struct exfat_inode_info *self = inode ? EXFAT_I(inode) : NULL;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	*len = 0;
+
+	if ((p_fs->amap_sum == NULL) || (want == 0))
+		return CLUSTER_32(~0);
+
+	from = ((clu >= 2) && (clu < p_fs->num_clusters)) ? clu - 2 : 0;
+	b = from;
+	to = p_fs->num_clusters - 2;
+
+	for (;;) {
+		start = amap_scan(sb, b, to, want, &best, &best_len);
+		if (start == CLUSTER_32(~0)) {
+			if (wrapped || (from == 0))
+				break;
+			wrapped = TRUE;
+			b = 0;
+			to = from;
+			continue;
+		}
+
+		end = prealloc_overlap(p_fs, self, start + 2, want, NULL);
+		if (!end) {
+			*len = want;
+			return start + 2;
+		}
+
+		/* skip over the window of the other file */
+		b = end - 2;
+	}
+
+	if (!best_len || prealloc_overlap(p_fs, self, best + 2, best_len, NULL))
+		return CLUSTER_32(~0);
+
+	*len = best_len;
+	return best + 2;
+} /* end of find_free_run */
+
+/* number of free clusters in a row from 'clu' on, up to 'max' */
+static u32 amap_run_len(struct super_block *sb, u32 clu, u32 max)
+{
+	u32 n;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	for (n = 0; (n < max) && ((clu + n) < p_fs->num_clusters); n++) {
+		if (amap_test(sb, clu + n - 2))
+			break;
+	}
+	return n;
+} /* end of amap_run_len */
+
+/*
+ * exfat_prealloc_hint : pick the cluster to append to a file with, which
+ * has 'num_clusters' clusters ending at 'last_clu'. A file being appended
+ * to keeps a window of free clusters past its end, that the allocator
+ * leaves to it in memory only; so that files written side by side do not
+ * interleave and can stay NoFatChain. The window grows with the file.
+ */
+u32 exfat_prealloc_hint(struct inode *inode, u32 last_clu, s32 num_clusters)
+{
+	u32 start, want, len = 0, w_start;
+	struct exfat_inode_info *ei = EXFAT_I(inode);
+	struct super_block *sb = inode->i_sb;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	if (p_fs->amap_sum == NULL)
+		return (last_clu == CLUSTER_32(~0)) ? CLUSTER_32(~0) : last_clu+1;
+
+	spin_lock(&p_fs->prealloc_lock);
+	if (ei->prealloc_len &&
+	    ((last_clu == CLUSTER_32(~0)) || (ei->prealloc_start == last_clu+1)) &&
+	    !amap_test(sb, ei->prealloc_start - 2)) {
+		start = ei->prealloc_start++;
+		if (--ei->prealloc_len == 0)
+			list_del_init(&ei->prealloc_list);
+		spin_unlock(&p_fs->prealloc_lock);
+		return start;
+	}
+	ei->prealloc_len = 0;
+	list_del_init(&ei->prealloc_list);
+	spin_unlock(&p_fs->prealloc_lock);
+
+	want = clamp_t(u32, num_clusters, PREALLOC_MIN_SIZE, PREALLOC_MAX_SIZE);
+
+	if (last_clu != CLUSTER_32(~0)) {
+		/* stay contiguous for as long as the clusters after us are free */
+		start = last_clu + 1;
+		len = amap_run_len(sb, start, want);
+		if (len && prealloc_overlap(p_fs, ei, start, len, &w_start))
+			len = (w_start > start) ? w_start - start : 0;
+	}
+
+	if (!len) {
+		start = find_free_run(sb, (last_clu == CLUSTER_32(~0)) ?
+				      p_fs->clu_srch_ptr : last_clu+1, want, inode, &len);
+		if (start == CLUSTER_32(~0))
+			return (last_clu == CLUSTER_32(~0)) ? CLUSTER_32(~0) : last_clu+1;
+	}
+
+	if (len > 1) {
+		spin_lock(&p_fs->prealloc_lock);
+		ei->prealloc_start = start + 1;
+		ei->prealloc_len = len - 1;
+		list_add_tail(&ei->prealloc_list, &p_fs->prealloc_list);
+		spin_unlock(&p_fs->prealloc_lock);
+	}
+
+	return start;
+} /* end of exfat_prealloc_hint */
+
+/* exfat_prealloc_discard : give back the window set aside for 'inode' */
+void exfat_prealloc_discard(struct inode *inode)
+{
+	struct exfat_inode_info *ei = EXFAT_I(inode);
+	FS_INFO_T *p_fs = &(EXFAT_SB(inode->i_sb)->fs_info);
+
+	spin_lock(&p_fs->prealloc_lock);
+	ei->prealloc_len = 0;
+	list_del_init(&ei->prealloc_list);
+	spin_unlock(&p_fs->prealloc_lock);
+} /* end of exfat_prealloc_discard */
+
 void sync_alloc_bitmap(struct super_block *sb)
 {
 	int i;
@@ -415,6 +415,16 @@ typedef struct {
 	CHAIN_T     clu;
 } UENTRY_T;
 
+/* free space summary of one allocation bitmap sector */
+typedef struct {
+	u16      free;                   /* num of free clusters */
+	u16      max_run;                /* longest free run, or AMAP_RUN_UNKNOWN */
+	u16      head;                   /* free clusters at the start */
+	u16      tail;                   /* free clusters at the end */
+} AMAP_SUM_T;
+
+#define AMAP_RUN_UNKNOWN        0xFFFF
+
 typedef struct {
 	s32       (*alloc_cluster)(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain);
 	void        (*free_cluster)(struct super_block *sb, CHAIN_T *p_chain, s32 do_relse);
@@ -473,6 +483,11 @@ typedef struct __FS_INFO_T {
 	u32      map_clu;                /* allocation bitmap start cluster */
 	u32      map_sectors;            /* num of allocation bitmap sectors */
 	struct buffer_head **vol_amap;      /* allocation bitmap */
+	AMAP_SUM_T  *amap_sum;           /* per bitmap sector, see find_free_run() */
+
+	/* in-memory preallocation windows of appending files */
+	spinlock_t  prealloc_lock;
+	struct list_head prealloc_list;
 
 	u16      **vol_utbl;               /* upcase table */
 
@@ -483,17 +498,25 @@ typedef struct __FS_INFO_T {
 	u32      dev_ejected;            /* block device operation error flag */
 
 	FS_FUNC_T	*fs_func;
-	struct semaphore v_sem;
+	struct rw_semaphore v_sem;       /* shared only for cluster lookups */
 
 	/* FAT cache */
-	BUF_CACHE_T FAT_cache_array[FAT_CACHE_SIZE];
+	struct semaphore FAT_cache_sem;
+	BUF_CACHE_T *FAT_cache_array;
 	BUF_CACHE_T FAT_cache_lru_list;
-	BUF_CACHE_T FAT_cache_hash_list[FAT_CACHE_HASH_SIZE];
+	BUF_CACHE_T *FAT_cache_hash_list;
+	u32      FAT_cache_size;         /* num of entries, sized at mount */
+	u32      FAT_cache_hash_mask;
+	u32      FAT_ra_start;           /* last FAT readahead window */
+	u32      FAT_ra_end;
 
 	/* buf cache */
-	BUF_CACHE_T buf_cache_array[BUF_CACHE_SIZE];
+	struct semaphore buf_cache_sem;
+	BUF_CACHE_T *buf_cache_array;
 	BUF_CACHE_T buf_cache_lru_list;
-	BUF_CACHE_T buf_cache_hash_list[BUF_CACHE_HASH_SIZE];
+	BUF_CACHE_T *buf_cache_hash_list;
+	u32      buf_cache_size;         /* num of entries, sized at mount */
+	u32      buf_cache_hash_mask;
 } FS_INFO_T;
 
 #define ES_2_ENTRIES		2
@@ -536,7 +559,7 @@ s32 ffsRemoveFile(struct inode *inode, FILE_ID_T *fid);
 s32 ffsSetAttr(struct inode *inode, u32 attr);
 s32 ffsGetStat(struct inode *inode, DIR_ENTRY_T *info);
 s32 ffsSetStat(struct inode *inode, DIR_ENTRY_T *info);
-s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu);
+s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu, u32 *clu_count, s32 alloc);
 
 /* directory management functions */
 s32 ffsCreateDir(struct inode *inode, char *path, FILE_ID_T *fid);
@@ -573,6 +596,9 @@ s32   set_alloc_bitmap(struct super_block *sb, u32 clu);
 s32   clr_alloc_bitmap(struct super_block *sb, u32 clu);
 u32 test_alloc_bitmap(struct super_block *sb, u32 clu);
 void   sync_alloc_bitmap(struct super_block *sb);
+u32 find_free_run(struct super_block *sb, u32 clu, u32 want, struct inode *inode, u32 *len);
+u32 exfat_prealloc_hint(struct inode *inode, u32 last_clu, s32 num_clusters);
+void   exfat_prealloc_discard(struct inode *inode);
 
 /* upcase table management functions */
 s32  load_upcase_table(struct super_block *sb);
@@ -50,9 +50,18 @@
 
 /* cache size (in number of sectors)                */
 /* (should be an exponential value of 2)            */
+/* the caches are sized at mount time within these  */
+/* bounds, after the size of the FAT and the volume */
 #define FAT_CACHE_SIZE          128
-#define FAT_CACHE_HASH_SIZE     64
+#define FAT_CACHE_MAX_SIZE      2048
 #define BUF_CACHE_SIZE          256
-#define BUF_CACHE_HASH_SIZE     64
+#define BUF_CACHE_MAX_SIZE      2048
+
+/* number of FAT sectors read ahead on a cache miss */
+#define FAT_RA_SIZE             32
+
+/* clusters set aside in memory ahead of a file being appended to */
+#define PREALLOC_MIN_SIZE       16
+#define PREALLOC_MAX_SIZE       1024
 
 #endif /* _EXFAT_DATA_H */
@@ -43,6 +43,7 @@
 /************************************************************************/
 
 #include <linux/semaphore.h>
+#include <linux/rwsem.h>
 #include <linux/time.h>
 
 #include "exfat_config.h"
@@ -74,6 +75,35 @@ void sm_V(struct semaphore *sm)
 	up(sm);
 } /* end of sm_V */
 
+/* reader/writer variant, for sections that may run concurrently */
+s32 rwsm_init(struct rw_semaphore *sm)
+{
+	init_rwsem(sm);
+	return 0;
+} /* end of rwsm_init */
+
+s32 rwsm_P_read(struct rw_semaphore *sm)
+{
+	down_read(sm);
+	return 0;
+} /* end of rwsm_P_read */
+
+void rwsm_V_read(struct rw_semaphore *sm)
+{
+	up_read(sm);
+} /* end of rwsm_V_read */
+
+s32 rwsm_P_write(struct rw_semaphore *sm)
+{
+	down_write(sm);
+	return 0;
+} /* end of rwsm_P_write */
+
+void rwsm_V_write(struct rw_semaphore *sm)
+{
+	up_write(sm);
+} /* end of rwsm_V_write */
+
 
 /*======================================================================*/
 /*                                                                      */
@@ -37,6 +37,7 @@
 #define _EXFAT_OAL_H
 
 #include <linux/semaphore.h>
+#include <linux/rwsem.h>
 #include "exfat_config.h"
 #include <linux/version.h>
 
@@ -68,6 +69,11 @@ typedef struct {
 s32 sm_init(struct semaphore *sm);
 s32 sm_P(struct semaphore *sm);
 void  sm_V(struct semaphore *sm);
+s32 rwsm_init(struct rw_semaphore *sm);
+s32 rwsm_P_read(struct rw_semaphore *sm);
+void  rwsm_V_read(struct rw_semaphore *sm);
+s32 rwsm_P_write(struct rw_semaphore *sm);
+void  rwsm_V_write(struct rw_semaphore *sm);
 
 TIMESTAMP_T *tm_current(TIMESTAMP_T *tm);
 
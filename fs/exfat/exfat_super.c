@@ -830,6 +830,7 @@ static int exfat_unlink(struct inode *dir, struct dentry *dentry)
 			err = -EIO;
 		goto out;
 	}
+	extent_cache_inval_inode(inode);
 	dir->i_version++;
 	dir->i_mtime = dir->i_atime = ts;
 	if (IS_DIRSYNC(dir))
@@ -1318,6 +1319,7 @@ static int exfat_file_release(struct inode *inode, struct file *filp)
 	struct super_block *sb = inode->i_sb;
 
 	EXFAT_I(inode)->fid.size = i_size_read(inode);
+	exfat_prealloc_discard(inode);
 	FsSyncVol(sb, 0);
 	return 0;
 }
@@ -1348,6 +1350,7 @@ static void _exfat_truncate(struct inode *inode, loff_t old_size)
 	int err;
 
 	__lock_super(sb);
+	down_write(&EXFAT_I(inode)->map_sem);
 
 	/*
 	 * This protects against truncating a file bigger than it was then
@@ -1372,6 +1375,7 @@ static void _exfat_truncate(struct inode *inode, loff_t old_size)
 	inode->i_blocks = ((i_size_read(inode) + (p_fs->cluster_size - 1))
 					   & ~((loff_t)p_fs->cluster_size - 1)) >> 9;
 out:
+	up_write(&EXFAT_I(inode)->map_sem);
 	__unlock_super(sb);
 }
 
@@ -1394,7 +1398,13 @@ const struct inode_operations exfat_file_inode_operations = {
 /*  Address Space Operations                                            */
 /*======================================================================*/
 
+/*
+ * Map 'sector' of the file, and as many of the following sectors (up to
+ * max_blocks) as are contiguous on disk, so that callers can build large
+ * bios.
+ */
 static int exfat_bmap(struct inode *inode, sector_t sector, sector_t *phys,
+					  unsigned long max_blocks,
 					  unsigned long *mapped_blocks, int *create)
 {
 	struct super_block *sb = inode->i_sb;
@@ -1405,7 +1415,7 @@ static int exfat_bmap(struct inode *inode, sector_t sector, sector_t *phys,
 	const unsigned char blocksize_bits = sb->s_blocksize_bits;
 	sector_t last_block;
 	int err, clu_offset, sec_offset;
-	unsigned int cluster;
+	unsigned int cluster, clu_count;
 
 	*phys = 0;
 	*mapped_blocks = 0;
@@ -1431,9 +1441,19 @@ static int exfat_bmap(struct inode *inode, sector_t sector, sector_t *phys,
 	clu_offset = sector >> p_fs->sectors_per_clu_bits;  /* cluster offset */
 	sec_offset = sector & (p_fs->sectors_per_clu - 1);  /* sector offset in cluster */
 
-	EXFAT_I(inode)->fid.size = i_size_read(inode);
+	/* only look ahead while reading existing blocks */
+	if (*create == 0)
+		max_blocks = min_t(sector_t, max_blocks, last_block - sector);
+	else
+		max_blocks = 1;
+	clu_count = (sec_offset + max_blocks + p_fs->sectors_per_clu - 1)
+		>> p_fs->sectors_per_clu_bits;
+
+	/* readers may share map_sem, only a writer may touch the fid */
+	if (*create)
+		EXFAT_I(inode)->fid.size = i_size_read(inode);
 
-	err = FsMapCluster(inode, clu_offset, &cluster);
+	err = FsMapCluster(inode, clu_offset, &cluster, &clu_count);
 
 	if (err) {
 		if (err == FFS_FULL)
@@ -1442,7 +1462,10 @@ static int exfat_bmap(struct inode *inode, sector_t sector, sector_t *phys,
 			return -EIO;
 	} else if (cluster != CLUSTER_32(~0)) {
 		*phys = START_SECTOR(cluster) + sec_offset;
-		*mapped_blocks = p_fs->sectors_per_clu - sec_offset;
+		*mapped_blocks = ((unsigned long)clu_count << p_fs->sectors_per_clu_bits)
+			- sec_offset;
+		if (*create == 0)
+			*mapped_blocks = min(*mapped_blocks, max_blocks);
 	}
 
 	return 0;
@@ -1452,32 +1475,42 @@ static int exfat_get_block(struct inode *inode, sector_t iblock,
 						   struct buffer_head *bh_result, int create)
 {
 	struct super_block *sb = inode->i_sb;
+	struct exfat_inode_info *ei = EXFAT_I(inode);
 	unsigned long max_blocks = bh_result->b_size >> inode->i_blkbits;
-	int err;
+	int err, locked_create = create;
 	unsigned long mapped_blocks;
 	sector_t phys;
 
-	__lock_super(sb);
+	/*
+	 * Readers of the file only look at its cluster chain and can map
+	 * concurrently; extending it updates mmu_private and the chain.
+	 */
+	if (locked_create)
+		down_write(&ei->map_sem);
+	else
+		down_read(&ei->map_sem);
 
-	err = exfat_bmap(inode, iblock, &phys, &mapped_blocks, &create);
-	if (err) {
-		__unlock_super(sb);
-		return err;
-	}
+	err = exfat_bmap(inode, iblock, &phys, max_blocks, &mapped_blocks, &create);
+	if (err)
+		goto out;
 
 	if (phys) {
 		max_blocks = min(mapped_blocks, max_blocks);
 		if (create) {
-			EXFAT_I(inode)->mmu_private += max_blocks << sb->s_blocksize_bits;
+			ei->mmu_private += max_blocks << sb->s_blocksize_bits;
 			set_buffer_new(bh_result);
 		}
 		map_bh(bh_result, sb, phys);
 	}
 
 	bh_result->b_size = max_blocks << sb->s_blocksize_bits;
-	__unlock_super(sb);
+out:
+	if (locked_create)
+		up_write(&ei->map_sem);
+	else
+		up_read(&ei->map_sem);
 
-	return 0;
+	return err;
 }
 
 static int exfat_readpage(struct file *file, struct page *page)
@@ -1827,6 +1860,8 @@ static void exfat_delete_inode(struct inode *inode)
 
 static void exfat_clear_inode(struct inode *inode)
 {
+	extent_cache_inval_inode(inode);
+	exfat_prealloc_discard(inode);
 	exfat_detach(inode);
 	remove_inode_hash(inode);
 }
@@ -1843,6 +1878,8 @@ static void exfat_evict_inode(struct inode *inode)
 #else
 	clear_inode(inode);
 #endif
+	extent_cache_inval_inode(inode);
+	exfat_prealloc_discard(inode);
 	exfat_detach(inode);
 
 	remove_inode_hash(inode);
@@ -2352,6 +2389,10 @@ static void init_once(void *foo)
 	struct exfat_inode_info *ei = (struct exfat_inode_info *)foo;
 
 	INIT_HLIST_NODE(&ei->i_hash_fat);
+	extent_cache_init_inode(&ei->vfs_inode);
+	init_rwsem(&ei->map_sem);
+	INIT_LIST_HEAD(&ei->prealloc_list);
+	ei->prealloc_len = 0;
 	inode_init_once(&ei->vfs_inode);
 }
 
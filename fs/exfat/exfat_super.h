@@ -99,10 +99,23 @@ struct exfat_sb_info {
 struct exfat_inode_info {
 	FILE_ID_T fid;
 	char  *target;
-	/* NOTE: mmu_private is 64bits, so must hold ->i_mutex to access */
+	/* NOTE: mmu_private is 64bits, so must hold ->i_mutex or map_sem to access */
 	loff_t mmu_private;         /* physically allocated size */
 	loff_t i_pos;               /* on-disk position of directory entry or 0 */
 	struct hlist_node i_hash_fat;	/* hash by i_location */
+
+	/* cluster runs of the FAT chain, see extent_get_clus() */
+	spinlock_t cache_lru_lock;
+	struct list_head cache_lru;
+	int nr_caches;
+	unsigned int cache_valid_id;	/* for avoiding the race between
+					   alloc and free */
+	/* get_block: shared to map clusters, exclusive to allocate them */
+	struct rw_semaphore map_sem;
+	/* free clusters set aside past the end, see exfat_prealloc_hint() */
+	struct list_head prealloc_list;
+	u32 prealloc_start;
+	u32 prealloc_len;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,00)
 	struct rw_semaphore truncate_lock;
 #endif
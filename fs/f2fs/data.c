@@ -268,55 +268,257 @@ int f2fs_reserve_block(struct dnode_of_data *dn, pgoff_t index)
 	return err;
 }
 
+static struct kmem_cache *extent_node_slab;
+
+/*
+ * Extent cache
+ *
+ * Besides the largest extent, which is also kept in the on-disk inode,
+ * every inode caches the extents it has looked up or written in an
+ * rb-tree indexed by file offset, protected by ext.ext_lock. All extent
+ * nodes of a file system sit on one lru list, from which the shrinker
+ * takes the oldest back under memory pressure.
+ */
+static struct extent_node *__attach_extent_node(struct f2fs_sb_info *sbi,
+				struct f2fs_inode_info *fi, unsigned int fofs,
+				u32 blk_addr, unsigned int len)
+{
+	struct rb_node **p = &fi->ext_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct extent_node *en;
+
+	while (*p) {
+		parent = *p;
+		en = rb_entry(parent, struct extent_node, rb_node);
+		if (fofs < en->fofs)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	/* called under ext_lock, we can not sleep here */
+	en = kmem_cache_alloc(extent_node_slab, GFP_ATOMIC);
+	if (!en)
+		return NULL;
+
+	en->fi = fi;
+	en->fofs = fofs;
+	en->blk_addr = blk_addr;
+	en->len = len;
+	rb_link_node(&en->rb_node, parent, p);
+	rb_insert_color(&en->rb_node, &fi->ext_tree);
+
+	spin_lock(&sbi->extent_lock);
+	list_add_tail(&en->list, &sbi->extent_list);
+	spin_unlock(&sbi->extent_lock);
+	atomic_inc(&sbi->total_ext_node);
+	return en;
+}
+
+static void __release_extent_node(struct f2fs_sb_info *sbi,
+				struct f2fs_inode_info *fi, struct extent_node *en)
+{
+	rb_erase(&en->rb_node, &fi->ext_tree);
+	if (fi->ext_cached == en)
+		fi->ext_cached = NULL;
+
+	spin_lock(&sbi->extent_lock);
+	list_del(&en->list);
+	spin_unlock(&sbi->extent_lock);
+	atomic_dec(&sbi->total_ext_node);
+	kmem_cache_free(extent_node_slab, en);
+}
+
+/* the extent holding fofs or, failing that, the one before it */
+static struct extent_node *__lookup_extent_node(struct f2fs_inode_info *fi,
+				unsigned int fofs, struct extent_node **prev)
+{
+	struct rb_node *node = fi->ext_tree.rb_node;
+	struct extent_node *en;
+
+	*prev = NULL;
+	while (node) {
+		en = rb_entry(node, struct extent_node, rb_node);
+		if (fofs < en->fofs) {
+			node = node->rb_left;
+		} else if (fofs >= en->fofs + en->len) {
+			*prev = en;
+			node = node->rb_right;
+		} else {
+			return en;
+		}
+	}
+	return NULL;
+}
+
+/* forget what is cached about [fofs, fofs + len) */
+static void __drop_extent_range(struct f2fs_sb_info *sbi,
+		struct f2fs_inode_info *fi, unsigned int fofs, unsigned int len)
+{
+	unsigned int end = fofs + len, en_end;
+	struct extent_node *en, *prev;
+	struct rb_node *node;
+
+	en = __lookup_extent_node(fi, fofs, &prev);
+	if (!en) {
+		node = prev ? rb_next(&prev->rb_node) : rb_first(&fi->ext_tree);
+		en = node ? rb_entry(node, struct extent_node, rb_node) : NULL;
+	}
+
+	while (en && en->fofs < end) {
+		node = rb_next(&en->rb_node);
+		en_end = en->fofs + en->len;
+
+		if (en->fofs < fofs && en_end > end) {
+			/* split it, the right part may just be lost */
+			en->len = fofs - en->fofs;
+			__attach_extent_node(sbi, fi, end,
+				en->blk_addr + end - en->fofs, en_end - end);
+			break;
+		} else if (en->fofs < fofs) {
+			en->len = fofs - en->fofs;
+		} else if (en_end > end) {
+			en->blk_addr += end - en->fofs;
+			en->len = en_end - end;
+			en->fofs = end;
+		} else {
+			__release_extent_node(sbi, fi, en);
+		}
+		en = node ? rb_entry(node, struct extent_node, rb_node) : NULL;
+	}
+}
+
+/* cache [fofs, fofs + len) at blk_addr, which must not be cached yet */
+static struct extent_node *__insert_extent(struct f2fs_sb_info *sbi,
+		struct f2fs_inode_info *fi, unsigned int fofs,
+		u32 blk_addr, unsigned int len)
+{
+	struct extent_node *en, *prev, *next = NULL;
+	struct rb_node *node;
+
+	__lookup_extent_node(fi, fofs, &prev);
+	node = prev ? rb_next(&prev->rb_node) : rb_first(&fi->ext_tree);
+	if (node)
+		next = rb_entry(node, struct extent_node, rb_node);
+
+	/* Back merge with the previous extent */
+	if (prev && prev->fofs + prev->len == fofs &&
+			prev->blk_addr + prev->len == blk_addr) {
+		prev->len += len;
+		en = prev;
+		if (next && en->fofs + en->len == next->fofs &&
+				en->blk_addr + en->len == next->blk_addr) {
+			en->len += next->len;
+			__release_extent_node(sbi, fi, next);
+		}
+		return en;
+	}
+
+	/* Front merge with the next one */
+	if (next && fofs + len == next->fofs &&
+			blk_addr + len == next->blk_addr) {
+		next->fofs = fofs;
+		next->blk_addr = blk_addr;
+		next->len += len;
+		return next;
+	}
+
+	return __attach_extent_node(sbi, fi, fofs, blk_addr, len);
+}
+
 static int check_extent_cache(struct inode *inode, pgoff_t pgofs,
-					struct buffer_head *bh_result)
+			struct buffer_head *bh_result, unsigned int *gen)
 {
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
 	struct f2fs_inode_info *fi = F2FS_I(inode);
+	struct extent_node *en = NULL, *prev;
+	unsigned int blkbits = inode->i_sb->s_blocksize_bits;
 	pgoff_t start_fofs, end_fofs;
 	block_t start_blkaddr;
-
-	if (is_inode_flag_set(fi, FI_NO_EXTENT))
-		return 0;
+	size_t count;
 
 	read_lock(&fi->ext.ext_lock);
-	if (fi->ext.len == 0) {
+	*gen = fi->ext_gen;
+
+	if (is_inode_flag_set(fi, FI_NO_EXTENT)) {
 		read_unlock(&fi->ext.ext_lock);
 		return 0;
 	}
 
 	stat_inc_total_hit(inode->i_sb);
 
-	start_fofs = fi->ext.fofs;
-	end_fofs = fi->ext.fofs + fi->ext.len - 1;
-	start_blkaddr = fi->ext.blk_addr;
-
-	if (pgofs >= start_fofs && pgofs <= end_fofs) {
-		unsigned int blkbits = inode->i_sb->s_blocksize_bits;
-		size_t count;
-
-		clear_buffer_new(bh_result);
-		map_bh(bh_result, inode->i_sb,
-				start_blkaddr + pgofs - start_fofs);
-		count = end_fofs - pgofs + 1;
-		if (count < (UINT_MAX >> blkbits))
-			bh_result->b_size = (count << blkbits);
-		else
-			bh_result->b_size = UINT_MAX;
+	if (fi->ext.len && pgofs >= fi->ext.fofs &&
+			pgofs < fi->ext.fofs + fi->ext.len) {
+		start_fofs = fi->ext.fofs;
+		end_fofs = fi->ext.fofs + fi->ext.len - 1;
+		start_blkaddr = fi->ext.blk_addr;
+		stat_inc_largest_hit(inode->i_sb);
+		goto found;
+	}
 
-		stat_inc_read_hit(inode->i_sb);
-		read_unlock(&fi->ext.ext_lock);
-		return 1;
+	en = fi->ext_cached;
+	if (en && pgofs >= en->fofs && pgofs < en->fofs + en->len) {
+		stat_inc_cached_hit(inode->i_sb);
+	} else {
+		en = __lookup_extent_node(fi, pgofs, &prev);
+		if (!en) {
+			read_unlock(&fi->ext.ext_lock);
+			return 0;
+		}
+		/* a plain pointer store, ext_cached is only a hint */
+		fi->ext_cached = en;
+		stat_inc_rbtree_hit(inode->i_sb);
 	}
+
+	start_fofs = en->fofs;
+	end_fofs = en->fofs + en->len - 1;
+	start_blkaddr = en->blk_addr;
+
+	spin_lock(&sbi->extent_lock);
+	list_move_tail(&en->list, &sbi->extent_list);
+	spin_unlock(&sbi->extent_lock);
+found:
+	clear_buffer_new(bh_result);
+	map_bh(bh_result, inode->i_sb, start_blkaddr + pgofs - start_fofs);
+	count = end_fofs - pgofs + 1;
+	if (count < (UINT_MAX >> blkbits))
+		bh_result->b_size = (count << blkbits);
+	else
+		bh_result->b_size = UINT_MAX;
+
+	stat_inc_read_hit(inode->i_sb);
 	read_unlock(&fi->ext.ext_lock);
-	return 0;
+	return 1;
+}
+
+/*
+ * Cache a mapping found in the node pages. It is dropped if any block
+ * of the file moved since gen was sampled, as it may be stale then.
+ */
+static void cache_extent(struct inode *inode, pgoff_t fofs,
+			block_t blk_addr, unsigned int len, unsigned int gen)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+
+	if (is_inode_flag_set(fi, FI_NO_EXTENT))
+		return;
+
+	write_lock(&fi->ext.ext_lock);
+	if (fi->ext_gen == gen) {
+		__drop_extent_range(sbi, fi, fofs, len);
+		__insert_extent(sbi, fi, fofs, blk_addr, len);
+	}
+	write_unlock(&fi->ext.ext_lock);
 }
 
 void update_extent_cache(block_t blk_addr, struct dnode_of_data *dn)
 {
+	struct f2fs_sb_info *sbi = F2FS_SB(dn->inode->i_sb);
 	struct f2fs_inode_info *fi = F2FS_I(dn->inode);
+	struct extent_node *en = NULL;
 	pgoff_t fofs, start_fofs, end_fofs;
-	block_t start_blkaddr, end_blkaddr;
-	int need_update = true;
+	int need_update = false;
 
 	f2fs_bug_on(blk_addr == NEW_ADDR);
 	fofs = start_bidx_of_node(ofs_of_node(dn->node_page), fi) +
@@ -329,68 +531,123 @@ void update_extent_cache(block_t blk_addr, struct dnode_of_data *dn)
 		return;
 
 	write_lock(&fi->ext.ext_lock);
+	fi->ext_gen++;
 
 	start_fofs = fi->ext.fofs;
 	end_fofs = fi->ext.fofs + fi->ext.len - 1;
-	start_blkaddr = fi->ext.blk_addr;
-	end_blkaddr = fi->ext.blk_addr + fi->ext.len - 1;
-
-	/* Drop and initialize the matched extent */
-	if (fi->ext.len == 1 && fofs == start_fofs)
-		fi->ext.len = 0;
-
-	/* Initial extent */
-	if (fi->ext.len == 0) {
-		if (blk_addr != NULL_ADDR) {
-			fi->ext.fofs = fofs;
-			fi->ext.blk_addr = blk_addr;
-			fi->ext.len = 1;
-		}
-		goto end_update;
-	}
 
-	/* Front merge */
-	if (fofs == start_fofs - 1 && blk_addr == start_blkaddr - 1) {
-		fi->ext.fofs--;
-		fi->ext.blk_addr--;
-		fi->ext.len++;
-		goto end_update;
-	}
-
-	/* Back merge */
-	if (fofs == end_fofs + 1 && blk_addr == end_blkaddr + 1) {
-		fi->ext.len++;
-		goto end_update;
-	}
-
-	/* Split the existing extent */
-	if (fi->ext.len > 1 &&
-		fofs >= start_fofs && fofs <= end_fofs) {
+	/* Split the largest extent, keeping its bigger part */
+	if (fi->ext.len && fofs >= start_fofs && fofs <= end_fofs) {
 		if ((end_fofs - fofs) < (fi->ext.len >> 1)) {
 			fi->ext.len = fofs - start_fofs;
 		} else {
 			fi->ext.fofs = fofs + 1;
-			fi->ext.blk_addr = start_blkaddr +
-					fofs - start_fofs + 1;
+			fi->ext.blk_addr += fofs - start_fofs + 1;
 			fi->ext.len -= fofs - start_fofs + 1;
 		}
-	} else {
-		need_update = false;
+		if (fi->ext.len < F2FS_MIN_EXTENT_LEN)
+			fi->ext.len = 0;
+		need_update = true;
 	}
 
-	/* Finally, if the extent is very fragmented, let's drop the cache. */
-	if (fi->ext.len < F2FS_MIN_EXTENT_LEN) {
-		fi->ext.len = 0;
-		set_inode_flag(fi, FI_NO_EXTENT);
+	__drop_extent_range(sbi, fi, fofs, 1);
+	if (blk_addr != NULL_ADDR)
+		en = __insert_extent(sbi, fi, fofs, blk_addr, 1);
+
+	/* Keep the largest extent in the inode, once it is worth it */
+	if (en && en->len >= F2FS_MIN_EXTENT_LEN && en->len > fi->ext.len) {
+		fi->ext.fofs = en->fofs;
+		fi->ext.blk_addr = en->blk_addr;
+		fi->ext.len = en->len;
 		need_update = true;
 	}
-end_update:
+
 	write_unlock(&fi->ext.ext_lock);
 	if (need_update)
 		sync_inode_page(dn);
 	return;
 }
 
+void f2fs_destroy_extent_tree(struct inode *inode)
+{
+	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	struct rb_node *node;
+
+	write_lock(&fi->ext.ext_lock);
+	while ((node = rb_first(&fi->ext_tree)))
+		__release_extent_node(sbi, fi,
+				rb_entry(node, struct extent_node, rb_node));
+	write_unlock(&fi->ext.ext_lock);
+}
+
+static int f2fs_shrink_extent_cache(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct f2fs_sb_info *sbi = container_of(shrink,
+				struct f2fs_sb_info, extent_shrinker);
+	int nr_to_scan = sc->nr_to_scan;
+	struct extent_node *en;
+	struct f2fs_inode_info *fi;
+
+	if (!nr_to_scan)
+		goto out;
+
+	spin_lock(&sbi->extent_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&sbi->extent_list)) {
+		en = list_first_entry(&sbi->extent_list,
+					struct extent_node, list);
+		fi = en->fi;
+
+		/* lock order is ext_lock then extent_lock, so only try */
+		if (!write_trylock(&fi->ext.ext_lock)) {
+			list_move_tail(&en->list, &sbi->extent_list);
+			continue;
+		}
+		rb_erase(&en->rb_node, &fi->ext_tree);
+		if (fi->ext_cached == en)
+			fi->ext_cached = NULL;
+		list_del(&en->list);
+		write_unlock(&fi->ext.ext_lock);
+
+		atomic_dec(&sbi->total_ext_node);
+		kmem_cache_free(extent_node_slab, en);
+	}
+	spin_unlock(&sbi->extent_lock);
+out:
+	return atomic_read(&sbi->total_ext_node);
+}
+
+/*
+ * The lru list, its lock and the node count are set up early in
+ * f2fs_fill_super, since roll-forward recovery already caches extents.
+ */
+void f2fs_init_extent_cache(struct f2fs_sb_info *sbi)
+{
+	sbi->extent_shrinker.shrink = f2fs_shrink_extent_cache;
+	sbi->extent_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->extent_shrinker);
+}
+
+void f2fs_destroy_extent_cache(struct f2fs_sb_info *sbi)
+{
+	unregister_shrinker(&sbi->extent_shrinker);
+}
+
+int __init create_extent_cache(void)
+{
+	extent_node_slab = f2fs_kmem_cache_create("f2fs_extent_node",
+			sizeof(struct extent_node));
+	if (!extent_node_slab)
+		return -ENOMEM;
+	return 0;
+}
+
+void destroy_extent_cache(void)
+{
+	kmem_cache_destroy(extent_node_slab);
+}
+
 struct page *find_data_page(struct inode *inode, pgoff_t index, bool sync)
 {
 	struct f2fs_sb_info *sbi = F2FS_SB(inode->i_sb);
@@ -616,14 +873,16 @@ static int get_data_block(struct inode *inode, sector_t iblock,
 	unsigned maxblocks = bh_result->b_size >> blkbits;
 	struct dnode_of_data dn;
 	int mode = create ? ALLOC_NODE : LOOKUP_NODE_RA;
-	pgoff_t pgofs, end_offset;
+	pgoff_t pgofs, start_pgofs, end_offset;
 	int err = 0, ofs = 1;
 	bool allocated = false;
+	unsigned int gen = 0;
 
 	/* Get the page offset from the block offset(iblock) */
 	pgofs =	(pgoff_t)(iblock >> (PAGE_CACHE_SHIFT - blkbits));
+	start_pgofs = pgofs;
 
-	if (check_extent_cache(inode, pgofs, bh_result))
+	if (check_extent_cache(inode, pgofs, bh_result, &gen))
 		goto out;
 
 	if (create)
@@ -703,6 +962,9 @@ put_out:
 unlock_out:
 	if (create)
 		f2fs_unlock_op(sbi);
+	else if (!err && buffer_mapped(bh_result))
+		cache_extent(inode, start_pgofs, bh_result->b_blocknr,
+				bh_result->b_size >> blkbits, gen);
 out:
 	trace_f2fs_get_data_block(inode, iblock, bh_result, err);
 	return err;
@@ -19,6 +19,8 @@
 #include <linux/magic.h>
 #include <linux/kobject.h>
 #include <linux/sched.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
 
 #ifdef CONFIG_F2FS_CHECK_FS
 #define f2fs_bug_on(condition)	BUG_ON(condition)
@@ -195,6 +197,16 @@ struct extent_info {
 	unsigned int len;	/* length of the extent */
 };
 
+/* an extent in the per-inode extent cache tree */
+struct extent_node {
+	struct rb_node rb_node;		/* rb node located in rb-tree */
+	struct list_head list;		/* node in the global lru list */
+	struct f2fs_inode_info *fi;	/* inode owning this extent */
+	unsigned int fofs;		/* start offset in a file */
+	u32 blk_addr;			/* start block address of the extent */
+	unsigned int len;		/* length of the extent */
+};
+
 /*
  * i_advise uses FADVISE_XXX_BIT. We can add additional hints later.
  */
@@ -220,7 +232,10 @@ struct f2fs_inode_info {
 	unsigned int clevel;		/* maximum level of given file name */
 	nid_t i_xattr_nid;		/* node id that contains xattrs */
 	unsigned long long xattr_ver;	/* cp version of xattr modification */
-	struct extent_info ext;		/* in-memory extent cache entry */
+	struct extent_info ext;		/* largest extent, kept in the inode */
+	struct rb_root ext_tree;	/* cached extents, under ext.ext_lock */
+	struct extent_node *ext_cached;	/* last extent found in ext_tree */
+	unsigned int ext_gen;		/* bumped each time a block moves */
 	struct dir_inode_entry *dirty_dir;	/* the pointer of dirty dir */
 };
 
@@ -461,6 +476,12 @@ struct f2fs_sb_info {
 	struct list_head dir_inode_list;	/* dir inode list */
 	spinlock_t dir_inode_lock;		/* for dir inode list lock */
 
+	/* for extent cache */
+	struct list_head extent_list;		/* lru list of extent nodes */
+	spinlock_t extent_lock;			/* for extent_list */
+	atomic_t total_ext_node;		/* # of extent nodes */
+	struct shrinker extent_shrinker;	/* gives extent nodes back */
+
 	/* basic file system units */
 	unsigned int log_sectors_per_block;	/* log2 sectors per block */
 	unsigned int log_blocksize;		/* log2 block size */
@@ -505,6 +526,8 @@ struct f2fs_sb_info {
 	unsigned int segment_count[2];		/* # of allocated segments */
 	unsigned int block_count[2];		/* # of allocated blocks */
 	int total_hit_ext, read_hit_ext;	/* extent cache hit ratio */
+	int read_hit_largest, read_hit_cached;	/* hits by place */
+	int read_hit_rbtree;
 	int inline_inode;			/* # of inline_data inodes */
 	int bg_gc;				/* background gc calls */
 	unsigned int n_dirty_dirs;		/* # of dir inodes */
@@ -1258,6 +1281,11 @@ void f2fs_submit_page_mbio(struct f2fs_sb_info *, struct page *, block_t,
 int reserve_new_block(struct dnode_of_data *);
 int f2fs_reserve_block(struct dnode_of_data *, pgoff_t);
 void update_extent_cache(block_t, struct dnode_of_data *);
+void f2fs_destroy_extent_tree(struct inode *);
+void f2fs_init_extent_cache(struct f2fs_sb_info *);
+void f2fs_destroy_extent_cache(struct f2fs_sb_info *);
+int __init create_extent_cache(void);
+void destroy_extent_cache(void);
 struct page *find_data_page(struct inode *, pgoff_t, bool);
 struct page *get_lock_data_page(struct inode *, pgoff_t);
 struct page *get_new_data_page(struct inode *, struct page *, pgoff_t, bool);
@@ -1291,6 +1319,7 @@ struct f2fs_stat_info {
 	int all_area_segs, sit_area_segs, nat_area_segs, ssa_area_segs;
 	int main_area_segs, main_area_sections, main_area_zones;
 	int hit_ext, total_ext;
+	int hit_largest, hit_cached, hit_rbtree, ext_node;
 	int ndirty_node, ndirty_dent, ndirty_dirs, ndirty_meta;
 	int nats, sits, fnids;
 	int total_count, utilization;
@@ -1324,6 +1353,9 @@ static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
 #define stat_dec_dirty_dir(sbi)		((sbi)->n_dirty_dirs--)
 #define stat_inc_total_hit(sb)		((F2FS_SB(sb))->total_hit_ext++)
 #define stat_inc_read_hit(sb)		((F2FS_SB(sb))->read_hit_ext++)
+#define stat_inc_largest_hit(sb)	((F2FS_SB(sb))->read_hit_largest++)
+#define stat_inc_cached_hit(sb)		((F2FS_SB(sb))->read_hit_cached++)
+#define stat_inc_rbtree_hit(sb)		((F2FS_SB(sb))->read_hit_rbtree++)
 #define stat_inc_inline_inode(inode)					\
 	do {								\
 		if (f2fs_has_inline_data(inode))			\
@@ -1379,6 +1411,9 @@ void f2fs_destroy_root_stats(void);
 #define stat_dec_dirty_dir(sbi)
 #define stat_inc_total_hit(sb)
 #define stat_inc_read_hit(sb)
+#define stat_inc_largest_hit(sb)
+#define stat_inc_cached_hit(sb)
+#define stat_inc_rbtree_hit(sb)
 #define stat_inc_inline_inode(inode)
 #define stat_dec_inline_inode(inode)
 #define stat_inc_seg_type(sbi, curseg)
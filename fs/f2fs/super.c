@@ -365,6 +365,9 @@ static struct inode *f2fs_alloc_inode(struct super_block *sb)
 	fi->i_current_depth = 1;
 	fi->i_advise = 0;
 	rwlock_init(&fi->ext.ext_lock);
+	fi->ext_tree = RB_ROOT;
+	fi->ext_cached = NULL;
+	fi->ext_gen = 0;
 	init_rwsem(&fi->i_sem);
 
 	set_inode_flag(fi, FI_NEW_INODE);
@@ -425,6 +428,7 @@ static void f2fs_put_super(struct super_block *sb)
 
 	f2fs_destroy_stats(sbi);
 	stop_gc_thread(sbi);
+	f2fs_destroy_extent_cache(sbi);
 
 	/* We don't need to do checkpoint when it's clean */
 	if (sbi->s_dirty && get_pages(sbi, F2FS_DIRTY_NODES))
@@ -998,6 +1002,10 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 	INIT_LIST_HEAD(&sbi->dir_inode_list);
 	spin_lock_init(&sbi->dir_inode_lock);
 
+	INIT_LIST_HEAD(&sbi->extent_list);
+	spin_lock_init(&sbi->extent_lock);
+	atomic_set(&sbi->total_ext_node, 0);
+
 	init_orphan_info(sbi);
 
 	/* setup f2fs internal modules */
@@ -1089,6 +1097,8 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent)
 		if (err)
 			goto free_kobj;
 	}
+
+	f2fs_init_extent_cache(sbi);
 	return 0;
 
 free_kobj:
@@ -1172,10 +1182,13 @@ static int __init init_f2fs_fs(void)
 	err = create_checkpoint_caches();
 	if (err)
 		goto free_gc_caches;
+	err = create_extent_cache();
+	if (err)
+		goto free_checkpoint_caches;
 	f2fs_kset = kset_create_and_add("f2fs", NULL, fs_kobj);
 	if (!f2fs_kset) {
 		err = -ENOMEM;
-		goto free_checkpoint_caches;
+		goto free_extent_cache;
 	}
 	err = register_filesystem(&f2fs_fs_type);
 	if (err)
@@ -1186,6 +1199,8 @@ static int __init init_f2fs_fs(void)
 
 free_kset:
 	kset_unregister(f2fs_kset);
+free_extent_cache:
+	destroy_extent_cache();
 free_checkpoint_caches:
 	destroy_checkpoint_caches();
 free_gc_caches:
@@ -1205,6 +1220,7 @@ static void __exit exit_f2fs_fs(void)
 	remove_proc_entry("fs/f2fs", NULL);
 	f2fs_destroy_root_stats();
 	unregister_filesystem(&f2fs_fs_type);
+	destroy_extent_cache();
 	destroy_checkpoint_caches();
 	destroy_gc_caches();
 	destroy_segment_manager_caches();
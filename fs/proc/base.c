@@ -1154,6 +1154,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	task->signal->oom_adj = oom_adjust;
 
 	blocking_notifier_call_chain(&oom_adj_notifier_list, oom_adjust, task);
+	lowmem_adj_tree_update(task);
 
 	/*
 	 * Scale /proc/pid/oom_score_adj appropriately ensuring that a maximum
@@ -1295,6 +1296,7 @@ static ssize_t oom_score_adj_write(struct file *file, const char __user *buf,
 	else
 		task->signal->oom_adj = (oom_score_adj * OOM_ADJUST_MAX) /
 							OOM_SCORE_ADJ_MAX;
+	lowmem_adj_tree_update(task);
 err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
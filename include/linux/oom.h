@@ -70,6 +70,22 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+extern void oom_adj_register_notify(struct notifier_block *nb);
+extern void oom_adj_unregister_notify(struct notifier_block *nb);
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_tree_add(struct task_struct *p);
+extern void lowmem_adj_tree_update(struct task_struct *p);
+#else
+static inline void lowmem_adj_tree_add(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_tree_update(struct task_struct *p)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
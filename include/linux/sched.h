@@ -1343,6 +1343,12 @@ struct task_struct {
 	struct pid_link pids[PIDTYPE_MAX];
 	struct list_head thread_group;
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* thread group leaders indexed by oom_adj, see lowmemorykiller.c */
+	struct rb_node lowmem_adj_node;
+	int lowmem_adj_key;
+#endif
+
 	struct completion *vfork_done;		/* for vfork() */
 	int __user *set_child_tid;		/* CLONE_CHILD_SETTID */
 	int __user *clear_child_tid;		/* CLONE_CHILD_CLEARTID */
@@ -0,0 +1,39 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+struct notifier_block;
+
+enum vmpressure_levels {
+	VMPRESSURE_LOW = 0,
+	VMPRESSURE_MEDIUM,
+	VMPRESSURE_CRITICAL,
+	VMPRESSURE_NUM_LEVELS,
+};
+
+#ifdef CONFIG_VMPRESSURE
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+extern void vmpressure_prio(gfp_t gfp, int prio);
+
+/*
+ * Notifiers are called from process context once per reclaim window with
+ * the level as @val and a pointer to the unsigned long pressure (0-100)
+ * as @data.
+ */
+extern int vmpressure_notifier_register(struct notifier_block *nb);
+extern int vmpressure_notifier_unregister(struct notifier_block *nb);
+#else
+static inline void vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed)
+{
+}
+
+static inline void vmpressure_prio(gfp_t gfp, int prio)
+{
+}
+#endif /* CONFIG_VMPRESSURE */
+
+#endif /* __LINUX_VMPRESSURE_H */
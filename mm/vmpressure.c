@@ -0,0 +1,281 @@
+/*
+ * Linux VM pressure
+ *
+ * Copyright 2012 Linaro Ltd.
+ *		  Anton Vorontsov <anton.vorontsov@linaro.org>
+ *
+ * Based on ideas from Andrew Morton, David Rientjes, KOSAKI Motohiro,
+ * Leonid Moiseichuk, Mel Gorman, Minchan Kim and Pekka Enberg.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * The page reclaimer reports how many pages it scanned and how many of
+ * them it managed to reclaim. Once a window's worth of pages has been
+ * scanned, the ratio is turned into a pressure value (0-100) and a level,
+ * which is reported to registered notifiers and to userspace through
+ * /sys/kernel/mm/vmpressure/. Poll the "level" file to be woken up each
+ * time a new level has been computed.
+ *
+ * Only global reclaim is accounted: this tree has no memory cgroup
+ * events, so levels go to in-kernel notifiers and sysfs instead.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/swap.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/notifier.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/vmpressure.h>
+
+/*
+ * The window size is the number of scanned pages after which a new level
+ * is computed. Smaller windows react faster but give noisier results.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+/*
+ * Percentage of scanned pages that were not reclaimed, at which the
+ * medium and critical levels start.
+ */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
+/*
+ * Reclaim priority (scan depth) at which we report critical pressure
+ * regardless of the reclaim ratio: the reclaimer is scanning more than
+ * a tenth of the LRUs and is clearly struggling.
+ */
+static const int vmpressure_level_critical_prio = ilog2(100 / 10);
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+static DEFINE_SPINLOCK(vmpressure_sr_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+
+static enum vmpressure_levels vmpressure_cur_level;
+static unsigned long vmpressure_cur_pressure;
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+static void vmpressure_work_fn(struct work_struct *work);
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+int vmpressure_notifier_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_register);
+
+int vmpressure_notifier_unregister(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_unregister);
+
+static enum vmpressure_levels vmpressure_level(unsigned long pressure)
+{
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static unsigned long vmpressure_calc_pressure(unsigned long scanned,
+					      unsigned long reclaimed)
+{
+	unsigned long scale = scanned + reclaimed;
+	unsigned long pressure;
+
+	/*
+	 * We calculate the ratio (in percents) of how many pages were
+	 * scanned vs. reclaimed in a given time frame (window). Note that
+	 * time is in VM reclaimer's "ticks", i.e. number of pages
+	 * scanned. This makes it possible to set desired reaction time
+	 * and serves as a ratelimit.
+	 */
+	pressure = scale - (reclaimed * scale / scanned);
+	pressure = pressure * 100 / scale;
+
+	pr_debug("%s: %3lu  (s: %lu  r: %lu)\n", __func__, pressure,
+		 scanned, reclaimed);
+
+	return pressure;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	unsigned long scanned;
+	unsigned long reclaimed;
+	unsigned long pressure;
+	enum vmpressure_levels level;
+
+	spin_lock(&vmpressure_sr_lock);
+	/*
+	 * Several contexts might be calling vmpressure(), so it is possible
+	 * that the work was rescheduled again before the old work context
+	 * cleared the counters. In that case we will run just after the old
+	 * work returns, but then scanned might be zero. This is OK, we
+	 * accounted that pressure already.
+	 */
+	scanned = vmpressure_scanned;
+	if (!scanned) {
+		spin_unlock(&vmpressure_sr_lock);
+		return;
+	}
+	reclaimed = vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_sr_lock);
+
+	/* reclaimed can exceed scanned when slab pages are freed */
+	if (reclaimed >= scanned)
+		pressure = 0;
+	else
+		pressure = vmpressure_calc_pressure(scanned, reclaimed);
+	level = vmpressure_level(pressure);
+
+	vmpressure_cur_pressure = pressure;
+	vmpressure_cur_level = level;
+
+	blocking_notifier_call_chain(&vmpressure_notifier, level, &pressure);
+#ifdef CONFIG_SYSFS
+	sysfs_notify(mm_kobj, "vmpressure", "level");
+#endif
+}
+
+/**
+ * vmpressure() - Account memory pressure through scanned/reclaimed ratio
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * This function should be called from the vmscan reclaim path to account
+ * "instantaneous" memory pressure (scanned/reclaimed ratio). Once a
+ * window's worth of pages has been scanned, a level is computed from the
+ * accumulated ratio and reported.
+ *
+ * This function does not return any value.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	/*
+	 * Here we only want to account pressure that userland is able to
+	 * help us with. For example, suppose that DMA zone is under
+	 * pressure; if we notify userland about that kind of pressure,
+	 * then it will be mostly a waste as it will trigger unnecessary
+	 * freeing of memory by userland (since userland is more likely to
+	 * have HIGHMEM/MOVABLE pages instead of the DMA fallback). That
+	 * is why we include only movable, highmem and FS/IO pages.
+	 * Indirect reclaim (kswapd) sets sc->gfp_mask to GFP_KERNEL, so
+	 * we account it too.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	/*
+	 * If we got here with no pages scanned, then that is an indicator
+	 * that reclaimer was unable to find any shrinkable LRUs at the
+	 * current scanning depth. But it does not mean that we should
+	 * report the critical pressure, yet. If the scanning priority
+	 * (scanning depth) goes too high (deep), we will be notified
+	 * through vmpressure_prio(). But so far, keep calm.
+	 */
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_sr_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	scanned = vmpressure_scanned;
+	spin_unlock(&vmpressure_sr_lock);
+
+	if (scanned < vmpressure_win)
+		return;
+	schedule_work(&vmpressure_work);
+}
+
+/**
+ * vmpressure_prio() - Account memory pressure through reclaimer priority level
+ * @gfp:	reclaimer's gfp mask
+ * @prio:	reclaimer's priority
+ *
+ * This function should be called from the reclaim path every time when
+ * the vmscan's reclaiming priority (scanning depth) changes.
+ *
+ * This function does not return any value.
+ */
+void vmpressure_prio(gfp_t gfp, int prio)
+{
+	/*
+	 * We only use prio for accounting critical level. For more info
+	 * see comment for vmpressure_level_critical_prio variable above.
+	 */
+	if (prio > vmpressure_level_critical_prio)
+		return;
+
+	/*
+	 * OK, the prio is below the threshold, updating vmpressure
+	 * information before shrinker dives into long shrinking of long
+	 * range vmscan. Passing scanned = vmpressure_win, reclaimed = 0
+	 * to the vmpressure() basically means that we signal 'critical'
+	 * level.
+	 */
+	vmpressure(gfp, vmpressure_win, 0);
+}
+
+#ifdef CONFIG_SYSFS
+
+/* see Documentation/ABI/testing/sysfs-kernel-mm-vmpressure */
+
+static ssize_t level_show(struct kobject *kobj,
+			  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", vmpressure_str_levels[vmpressure_cur_level]);
+}
+static struct kobj_attribute level_attr = __ATTR_RO(level);
+
+static ssize_t pressure_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", vmpressure_cur_pressure);
+}
+static struct kobj_attribute pressure_attr = __ATTR_RO(pressure);
+
+static struct attribute *vmpressure_attrs[] = {
+	&level_attr.attr,
+	&pressure_attr.attr,
+	NULL,
+};
+
+static struct attribute_group vmpressure_attr_group = {
+	.attrs = vmpressure_attrs,
+	.name = "vmpressure",
+};
+
+#endif /* CONFIG_SYSFS */
+
+static int __init vmpressure_init(void)
+{
+#ifdef CONFIG_SYSFS
+	int err;
+
+	err = sysfs_create_group(mm_kobj, &vmpressure_attr_group);
+	if (err)
+		printk(KERN_ERR "vmpressure: register sysfs failed\n");
+#endif /* CONFIG_SYSFS */
+	return 0;
+}
+module_init(vmpressure_init);